@@ -1,6 +1,115 @@
 #include "scene.h"
 #include "intersect.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define INTERSECT_SSE 1
+#endif
+
+// 4-wide float vector used to intersect ray packets, mapped to sse when available
+struct float4 {
+#ifdef INTERSECT_SSE
+    __m128 v;   // sse register
+
+    float4() { }
+    float4(__m128 v) : v(v) { }
+    float4(float a) : v(_mm_set1_ps(a)) { }
+    float4(float a, float b, float c, float d) : v(_mm_setr_ps(a,b,c,d)) { }
+
+    // lane bitmask of a comparison result
+    int mask() const { return _mm_movemask_ps(v); }
+    // store to an array
+    void store(float* a) const { _mm_storeu_ps(a, v); }
+#else
+    float v[4]; // lanes
+
+    float4() { }
+    float4(float a) { v[0] = v[1] = v[2] = v[3] = a; }
+    float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+
+    // lane bitmask of a comparison result
+    int mask() const { int m = 0; for (int i = 0; i < 4; i++) if (v[i]) m |= 1 << i; return m; }
+    // store to an array
+    void store(float* a) const { for (int i = 0; i < 4; i++) a[i] = v[i]; }
+#endif
+};
+
+#ifdef INTERSECT_SSE
+inline float4 operator+(const float4& a, const float4& b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator-(const float4& a, const float4& b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator*(const float4& a, const float4& b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/(const float4& a, const float4& b) { return _mm_div_ps(a.v, b.v); }
+inline float4 sqrt(const float4& a) { return _mm_sqrt_ps(a.v); }
+inline float4 abs(const float4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline float4 operator<(const float4& a, const float4& b) { return _mm_cmplt_ps(a.v, b.v); }
+inline float4 operator>(const float4& a, const float4& b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline float4 operator>=(const float4& a, const float4& b) { return _mm_cmpge_ps(a.v, b.v); }
+inline float4 operator!=(const float4& a, const float4& b) { return _mm_cmpneq_ps(a.v, b.v); }
+inline float4 operator&(const float4& a, const float4& b) { return _mm_and_ps(a.v, b.v); }
+// select a where mask is set and b elsewhere
+inline float4 select(const float4& mask, const float4& a, const float4& b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+#else
+#define float4_op(op, expr) inline float4 op(const float4& a, const float4& b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = expr; return r; }
+float4_op(operator+, a.v[i] + b.v[i])
+float4_op(operator-, a.v[i] - b.v[i])
+float4_op(operator*, a.v[i] * b.v[i])
+float4_op(operator/, a.v[i] / b.v[i])
+float4_op(operator<, (a.v[i] < b.v[i]) ? 1.0f : 0.0f)
+float4_op(operator>, (a.v[i] > b.v[i]) ? 1.0f : 0.0f)
+float4_op(operator>=, (a.v[i] >= b.v[i]) ? 1.0f : 0.0f)
+float4_op(operator!=, (a.v[i] != b.v[i]) ? 1.0f : 0.0f)
+float4_op(operator&, (a.v[i] && b.v[i]) ? 1.0f : 0.0f)
+#undef float4_op
+inline float4 sqrt(const float4& a) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = std::sqrt(a.v[i]); return r; }
+inline float4 abs(const float4& a) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = std::abs(a.v[i]); return r; }
+// select a where mask is set and b elsewhere
+inline float4 select(const float4& mask, const float4& a, const float4& b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = (mask.v[i]) ? a.v[i] : b.v[i]; return r; }
+#endif
+
+// packet of rays, stored as structure of arrays
+struct ray3f_packet {
+    float4 e[3];    // origins
+    float4 d[3];    // directions
+    float4 tmin;    // min t values
+    float4 tmax;    // max t values
+
+    // build a packet from up to four rays (missing lanes repeat the first ray)
+    ray3f_packet(const ray3f* rays, int nrays) {
+        const ray3f& r0 = rays[0];
+        const ray3f& r1 = rays[(nrays > 1) ? 1 : 0];
+        const ray3f& r2 = rays[(nrays > 2) ? 2 : 0];
+        const ray3f& r3 = rays[(nrays > 3) ? 3 : 0];
+        for (int a = 0; a < 3; a++) {
+            e[a] = float4(r0.e[a], r1.e[a], r2.e[a], r3.e[a]);
+            d[a] = float4(r0.d[a], r1.d[a], r2.d[a], r3.d[a]);
+        }
+        tmin = float4(r0.tmin, r1.tmin, r2.tmin, r3.tmin);
+        tmax = float4(r0.tmax, r1.tmax, r2.tmax, r3.tmax);
+    }
+};
+
+// intersect a quad with a packet of rays, same as intersect_quad,
+// returning the mask of rays that hit and their ray parameters
+int intersect_quad(const Surface& surface, const ray3f_packet& packet, float4& t){
+    vec3f normal = normalize(surface.frame.z);
+    vec3f o = surface.frame.o;
+
+    float4 denom = packet.d[0] * float4(normal.x) + packet.d[1] * float4(normal.y) + packet.d[2] * float4(normal.z);
+    float4 surface_dir[3] = { float4(o.x) - packet.e[0], float4(o.y) - packet.e[1], float4(o.z) - packet.e[2] };
+    t = (surface_dir[0] * float4(normal.x) + surface_dir[1] * float4(normal.y) + surface_dir[2] * float4(normal.z)) / denom;
+    // hit position relative to the quad center, projected on the quad axes
+    float4 pos[3] = { float4(0) - surface_dir[0] + packet.d[0] * t,
+                      float4(0) - surface_dir[1] + packet.d[1] * t,
+                      float4(0) - surface_dir[2] + packet.d[2] * t };
+    vec3f x = surface.frame.x, y = surface.frame.y;
+    float4 px = pos[0] * float4(x.x) + pos[1] * float4(x.y) + pos[2] * float4(x.z);
+    float4 py = pos[0] * float4(y.x) + pos[1] * float4(y.y) + pos[2] * float4(y.z);
+    float4 r = float4(surface.radius);
+    float4 hit = (denom != float4(0)) & (t > packet.tmin) & (packet.tmax > t) &
+                 (r > abs(px)) & (r > abs(py));
+    return hit.mask();
+}
+
 intersection3f intersect_quad(const Surface& surface,const ray3f& ray){
     vec3f normal = normalize(surface.frame.z);
 
@@ -74,6 +183,28 @@ intersection3f intersect_sphere(const Surface& surface,const ray3f& ray){
 }
 
 
+// intersect a sphere with a packet of rays, same as intersect_sphere,
+// returning the mask of rays that hit and their ray parameters
+int intersect_sphere(const Surface& surface, const ray3f_packet& packet, float4& t){
+    vec3f o = surface.frame.o;
+    float4 dir_to_center[3] = { packet.e[0] - float4(o.x), packet.e[1] - float4(o.y), packet.e[2] - float4(o.z) };
+
+    float4 b = float4(2) * (packet.d[0] * dir_to_center[0] + packet.d[1] * dir_to_center[1] + packet.d[2] * dir_to_center[2]);
+    float4 c = dir_to_center[0] * dir_to_center[0] + dir_to_center[1] * dir_to_center[1] +
+               dir_to_center[2] * dir_to_center[2] - float4(surface.radius * surface.radius);
+    float4 delta = b * b - float4(4) * c;
+    float4 valid = delta >= float4(0);
+
+    // pick the closest root within the ray range
+    float4 delta_sqr = sqrt(select(valid, delta, float4(0)));
+    float4 t1 = (float4(0) - b + delta_sqr) * float4(0.5f);
+    float4 t2 = (float4(0) - b - delta_sqr) * float4(0.5f);
+    float4 t1_in_range = (t1 > packet.tmin) & (packet.tmax > t1);
+    float4 t2_in_range = (t2 > packet.tmin) & (packet.tmax > t2);
+    t = select(t2_in_range, t2, t1);
+    return (valid & select(t2_in_range, t2_in_range, t1_in_range)).mask();
+}
+
 vec3f compute_cylinder_normal(const Surface& surface, const vec3f point){
     //    V = X - C
     //    Vperp = V - project(V, A)     // Project V onto A
@@ -121,3 +252,62 @@ intersection3f intersect_surfaces(Scene* scene, ray3f& ray) {
     }
     return intersection;
 }
+
+// intersects the scene's surfaces with a batch of rays, four at a time
+// as ray packets, and return the first intersections (used for raytracing homework)
+void intersect_surfaces(Scene* scene, const ray3f* rays, int nrays, intersection3f* intersections) {
+    for (int start = 0; start < nrays; start += 4) {
+        int n = min(4, nrays - start);
+        ray3f_packet packet = ray3f_packet(rays + start, n);
+        int lanes = (1 << n) - 1;
+        // closest surface and ray parameter found for each ray
+        Surface* closest[4] = { nullptr, nullptr, nullptr, nullptr };
+        float closest_t[4];
+
+        // foreach surface
+        for (Surface* surface: scene->surfaces) {
+            // cylinders are intersected one ray at a time
+            if (surface->iscylinder) {
+                for (int k = 0; k < n; k++) {
+                    intersection3f current_intersection = intersect_cylinder(*surface, rays[start + k]);
+                    if (current_intersection.hit && (!closest[k] || current_intersection.ray_t < closest_t[k])) {
+                        closest[k] = surface;
+                        closest_t[k] = current_intersection.ray_t;
+                    }
+                }
+                continue;
+            }
+            float4 t;
+            int hit = (surface->isquad) ? intersect_quad(*surface, packet, t) : intersect_sphere(*surface, packet, t);
+            hit &= lanes;
+            if (!hit) continue;
+            // record closest intersection
+            float ts[4];
+            t.store(ts);
+            for (int k = 0; k < n; k++) {
+                if ((hit & (1 << k)) && (!closest[k] || ts[k] < closest_t[k])) {
+                    closest[k] = surface;
+                    closest_t[k] = ts[k];
+                }
+            }
+        }
+
+        // set the intersection records, computing hit position and normal for each ray
+        for (int k = 0; k < n; k++) {
+            const ray3f& ray = rays[start + k];
+            intersection3f& intersection = intersections[start + k];
+            intersection = intersection3f();
+            if (!closest[k]) continue;
+            if (closest[k]->iscylinder) {
+                intersection = intersect_cylinder(*closest[k], ray);
+                continue;
+            }
+            intersection.hit = true;
+            intersection.ray_t = closest_t[k];
+            intersection.pos = ray.eval(closest_t[k]);
+            if (closest[k]->isquad) intersection.norm = normalize(closest[k]->frame.z);
+            else intersection.norm = normalize(intersection.pos - closest[k]->frame.o);
+            intersection.mat = closest[k]->mat;
+        }
+    }
+}
@@ -57,4 +57,8 @@ inline ray3f transform_ray_inverse(const frame3f& f, const ray3f& v) { return ra
 // intersects the scene's surfaces and return the first intersection (used for raytracing homework)
 intersection3f intersect_surfaces(Scene* scene, ray3f& ray);
 
+// intersects the scene's surfaces with a batch of rays, four at a time as ray packets,
+// and return the first intersections (used for raytracing homework)
+void intersect_surfaces(Scene* scene, const ray3f* rays, int nrays, intersection3f* intersections);
+
 #endif
@@ -37,11 +37,18 @@ int compute_shadow_coefficent(Scene* scene, vec3f surface_pnt, vec3f light_pnt){
     return 1;
 }
 
+// compute the color corresponing to a ray by raytracing, given its scene intersection
+vec3f raytrace_ray(Scene* scene, ray3f& ray, const intersection3f& intersection, int step=5);
+
 // compute the color corresponing to a ray by raytracing
 vec3f raytrace_ray(Scene* scene, ray3f& ray, int step=5);
 vec3f raytrace_ray(Scene* scene, ray3f& ray, int step) {
     // get scene intersection
     intersection3f intersection = intersect_surfaces(scene, ray);
+    return raytrace_ray(scene, ray, intersection, step);
+}
+
+vec3f raytrace_ray(Scene* scene, ray3f& ray, const intersection3f& intersection, int step) {
     // if not hit, return background
     if (!intersection.hit) {
         return scene->background;
@@ -92,15 +99,24 @@ image3f raytrace(Scene* scene) {
     // foreach pixel
     if (scene->image_samples == 1) {
         for(auto i : range(image.width())){
-            for(auto j: range(image.height())){
-                // compute ray-camera parameters (u,v) for the pixel
-                float u = (i + 0.5) / image.width();
-                float v = (j + 0.5) / image.height();
-                // compute camera ray
-                ray3f ray = generate_ray(*(scene->camera), u, v);
-                vec3f color = raytrace_ray(scene, ray);
-                // set pixel to the color raytraced with the ray
-                image.at(i, j) = color;
+            // trace the column four pixels at a time, intersecting camera rays as packets
+            for(int j = 0; j < image.height(); j += 4){
+                int n = min(4, image.height() - j);
+                ray3f rays[4];
+                intersection3f intersections[4];
+                for (int k = 0; k < n; k++) {
+                    // compute ray-camera parameters (u,v) for the pixel
+                    float u = (i + 0.5) / image.width();
+                    float v = (j + k + 0.5) / image.height();
+                    // compute camera ray
+                    rays[k] = generate_ray(*(scene->camera), u, v);
+                }
+                intersect_surfaces(scene, rays, n, intersections);
+                for (int k = 0; k < n; k++) {
+                    vec3f color = raytrace_ray(scene, rays[k], intersections[k]);
+                    // set pixel to the color raytraced with the ray
+                    image.at(i, j + k) = color;
+                }
             }
         }
     }
@@ -111,18 +127,24 @@ image3f raytrace(Scene* scene) {
             for(auto j: range(image.height())){
                 // init accumulated color
                 vec3f color = vec3f();
-                // foreach sample
+                // compute camera rays for all samples, intersected four at a time as packets
+                std::vector<ray3f> rays;
                 for (auto ii: range(scene->image_samples)) {
                     for (auto jj: range(scene->image_samples)){
                         // compute ray-camera parameters (u,v) for the pixel
                         float u = (i + ((ii+0.5)/scene->image_samples)) / image.width();
                         float v = (j + ((jj+0.5)/scene->image_samples)) / image.height();
                         // compute camera ray
-                        ray3f ray = generate_ray(*(scene->camera), u, v);
-                        // set pixel to the color raytraced with the ray
-                        color += raytrace_ray(scene, ray);
+                        rays.push_back(generate_ray(*(scene->camera), u, v));
                     }
                 }
+                std::vector<intersection3f> intersections(rays.size());
+                intersect_surfaces(scene, rays.data(), rays.size(), intersections.data());
+                // foreach sample
+                for (auto k: range(rays.size())) {
+                    // set pixel to the color raytraced with the ray
+                    color += raytrace_ray(scene, rays[k], intersections[k]);
+                }
                 // set pixel to the color raytraced with the ray
                 image.at(i, j) = color / pow(scene->image_samples, 2);
             }
@@ -179,3 +179,63 @@ void write_png(const string& filename, const image3f& img, bool flipY) {
     unsigned error = lodepng::encode(filename, img_png, img.width(), img.height());
     error_if_not(not error, "cannot write png image: %s", filename.c_str());
 }
+
+uint16_t float_to_half(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+    auto sign = (uint16_t)((bits >> 16) & 0x8000);
+    auto exp = (int)((bits >> 23) & 0xff) - 127 + 15;
+    auto mant = bits & 0x7fffff;
+    // nans stay nans, while infinities and overflows clamp to the largest half
+    if(((bits >> 23) & 0xff) == 0xff and mant) return sign | 0x7e00;
+    if(exp >= 31) return sign | 0x7bff;
+    // small values become subnormals, or zero
+    if(exp <= 0) {
+        if(exp < -10) return sign;
+        mant |= 0x800000;
+        auto shift = 14 - exp;
+        return sign | (uint16_t)((mant >> shift) + ((mant >> (shift-1)) & 1));
+    }
+    // round the mantissa to nearest, carrying into the exponent if needed
+    auto h = ((uint32_t)exp << 10) | (mant >> 13);
+    if(mant & 0x1000) h ++;
+    return sign | (uint16_t)((h > 0x7bff) ? 0x7bff : h);
+}
+
+texture3f::texture3f(const image3f& img, bool hdr) : _hdr(hdr) {
+    auto image = img;
+    while(true) {
+        // store the level in tiles, padding the last ones
+        auto level = _Level();
+        level.w = image.width(); level.h = image.height();
+        level.tiles_x = (level.w + texture3f_tile_size - 1) / texture3f_tile_size;
+        auto tiles_y = (level.h + texture3f_tile_size - 1) / texture3f_tile_size;
+        auto size = (size_t)level.tiles_x * tiles_y * texture3f_tile_size * texture3f_tile_size * 3;
+        level.offset = (hdr) ? _d16.size() : _d8.size();
+        if(hdr) _d16.resize(level.offset + size, 0);
+        else _d8.resize(level.offset + size, 0);
+        for(int j = 0; j < level.h; j ++) {
+            for(int i = 0; i < level.w; i ++) {
+                auto idx = level.offset + _texel_index(level, i, j) * 3;
+                auto v = image.at(i,j);
+                for(int c = 0; c < 3; c ++) {
+                    if(hdr) _d16[idx+c] = float_to_half(v[c]);
+                    else _d8[idx+c] = (uint8_t)clamp((int)round(v[c] * 255), 0, 255);
+                }
+            }
+        }
+        _levels.push_back(level);
+        if(level.w == 1 and level.h == 1) break;
+        
+        // halve the level by averaging 2x2 texels, clamping them at odd sizes
+        auto next = image3f(max(1, level.w/2), max(1, level.h/2));
+        for(int j = 0; j < next.height(); j ++) {
+            for(int i = 0; i < next.width(); i ++) {
+                auto i0 = min(2*i, level.w-1), i1 = min(2*i+1, level.w-1);
+                auto j0 = min(2*j, level.h-1), j1 = min(2*j+1, level.h-1);
+                next.at(i,j) = (image.at(i0,j0) + image.at(i1,j0) + image.at(i0,j1) + image.at(i1,j1)) / 4;
+            }
+        }
+        image = next;
+    }
+}
@@ -4,6 +4,9 @@
 #include "common.h"
 #include "vmath.h"
 
+#include <cstdint>
+#include <cstring>
+
 // A generic image
 struct image3f {
     // Default Constructor (empty image)
@@ -53,7 +56,7 @@ struct image3f {
     }
     
     // apply a scale to the image
-    image3f scale(float s) {
+    image3f scale(float s) const {
         image3f ret(width(),height());
         for(int j = 0; j < height(); j ++) {
             for(int i = 0; i < width(); i ++) {
@@ -68,6 +71,71 @@ private:
 	vector<vec3f> _d;
 };
 
+// convert a float to a half float, rounding to nearest
+uint16_t float_to_half(float f);
+// convert a half float to a float
+inline float half_to_float(uint16_t h) {
+    auto exp = (h >> 10) & 0x1f;
+    auto mant = (uint32_t)(h & 0x3ff);
+    auto f = 0.0f;
+    if(exp == 0) f = mant * (1.0f / (1 << 24));
+    else if(exp == 31) f = (mant) ? NAN : INFINITY;
+    else { auto bits = ((uint32_t)(exp + 112) << 23) | (mant << 13); memcpy(&f, &bits, 4); }
+    return (h & 0x8000) ? -f : f;
+}
+
+#define texture3f_tile_size 8  // tile side (the morton code of a texel in a tile has 3 bits per axis)
+
+// texture for filtered lookups: a mip pyramid of levels, each stored in tiles of
+// texture3f_tile_size^2 texels in morton order, so that the texels of a lookup are
+// close in memory; texels are stored as 8 bit values for low dynamic range images
+// and as half floats for high dynamic range ones
+struct texture3f {
+    // Default constructor (empty texture)
+    texture3f() { }
+    // Image constructor (builds the mip pyramid, with texels in [0,1] if not hdr)
+    texture3f(const image3f& img, bool hdr);
+    
+    // texture width
+    int width(int level = 0) const { return _levels[level].w; }
+    // texture height
+    int height(int level = 0) const { return _levels[level].h; }
+    // number of mip levels
+    int levels() const { return _levels.size(); }
+    // whether the texels are stored as half floats
+    bool hdr() const { return _hdr; }
+    
+    // texel access
+    vec3f at(int level, int i, int j) const {
+        auto idx = _levels[level].offset + _texel_index(_levels[level], i, j) * 3;
+        if(_hdr) return vec3f(half_to_float(_d16[idx]), half_to_float(_d16[idx+1]), half_to_float(_d16[idx+2]));
+        return vec3f(_d8[idx], _d8[idx+1], _d8[idx+2]) * (1 / 255.0f);
+    }
+    // texel access, at the finest level
+    vec3f at(int i, int j) const { return at(0, i, j); }
+    
+private:
+    // mip level layout
+    struct _Level {
+        int w = 0, h = 0;       // size
+        int tiles_x = 0;        // tiles in each row
+        size_t offset = 0;      // offset of the first texel value
+    };
+    
+    // index of a texel in a level, i.e. its tile and its morton code in the tile
+    static size_t _texel_index(const _Level& level, int i, int j) {
+        auto tile = (size_t)(j / texture3f_tile_size) * level.tiles_x + i / texture3f_tile_size;
+        auto ti = (unsigned)(i % texture3f_tile_size), tj = (unsigned)(j % texture3f_tile_size);
+        auto morton = (ti & 1) | ((tj & 1) << 1) | ((ti & 2) << 1) | ((tj & 2) << 2) | ((ti & 4) << 2) | ((tj & 4) << 3);
+        return tile * texture3f_tile_size * texture3f_tile_size + morton;
+    }
+    
+    vector<_Level>      _levels;
+    bool                _hdr = false;
+    vector<uint8_t>     _d8;
+    vector<uint16_t>    _d16;
+};
+
 // Write an floating point color PFM image file
 void write_pfm(const string& filename, const image3f& img, bool flipY = false);
 // Write an 8-bit color compressed PNG file (sets PNG alpha to 1 everywhere)
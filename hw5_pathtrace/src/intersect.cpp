@@ -2,35 +2,157 @@
 #include "intersect.h"
 
 #include <algorithm>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <chrono>
+
+#if defined(__SSE__) or defined(_M_X64) or (defined(_M_IX86_FP) and _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define INTERSECT_SSE 1
+#endif
+
+// 4-wide float vector used to trace ray packets, mapped to sse when available
+struct float4 {
+#ifdef INTERSECT_SSE
+    __m128 v;   // sse register
+    
+    // Default constructor (uninitialized)
+    float4() { }
+    // Register constructor
+    float4(__m128 v) : v(v) { }
+    // Broadcast constructor
+    float4(float a) : v(_mm_set1_ps(a)) { }
+    // Element-wise constructor
+    float4(float a, float b, float c, float d) : v(_mm_setr_ps(a,b,c,d)) { }
+    // Load constructor
+    explicit float4(const float* a) : v(_mm_loadu_ps(a)) { }
+    
+    // lane bitmask of a comparison result
+    int mask() const { return _mm_movemask_ps(v); }
+    // store to an array
+    void store(float* a) const { _mm_storeu_ps(a, v); }
+#else
+    float v[4]; // lanes
+    
+    // Default constructor (uninitialized)
+    float4() { }
+    // Broadcast constructor
+    float4(float a) { v[0] = v[1] = v[2] = v[3] = a; }
+    // Element-wise constructor
+    float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+    // Load constructor
+    explicit float4(const float* a) { v[0] = a[0]; v[1] = a[1]; v[2] = a[2]; v[3] = a[3]; }
+    
+    // lane bitmask of a comparison result
+    int mask() const { auto m = 0; for(auto i : range(4)) if(v[i]) m |= 1 << i; return m; }
+    // store to an array
+    void store(float* a) const { for(auto i : range(4)) a[i] = v[i]; }
+#endif
+};
+
+#ifdef INTERSECT_SSE
+inline float4 operator+(const float4& a, const float4& b) { return _mm_add_ps(a.v,b.v); }
+inline float4 operator-(const float4& a, const float4& b) { return _mm_sub_ps(a.v,b.v); }
+inline float4 operator*(const float4& a, const float4& b) { return _mm_mul_ps(a.v,b.v); }
+inline float4 operator/(const float4& a, const float4& b) { return _mm_div_ps(a.v,b.v); }
+inline float4 min(const float4& a, const float4& b) { return _mm_min_ps(a.v,b.v); }
+inline float4 max(const float4& a, const float4& b) { return _mm_max_ps(a.v,b.v); }
+inline float4 operator<(const float4& a, const float4& b) { return _mm_cmplt_ps(a.v,b.v); }
+inline float4 operator<=(const float4& a, const float4& b) { return _mm_cmple_ps(a.v,b.v); }
+inline float4 operator>(const float4& a, const float4& b) { return _mm_cmpgt_ps(a.v,b.v); }
+inline float4 operator>=(const float4& a, const float4& b) { return _mm_cmpge_ps(a.v,b.v); }
+inline float4 operator!=(const float4& a, const float4& b) { return _mm_cmpneq_ps(a.v,b.v); }
+inline float4 operator&(const float4& a, const float4& b) { return _mm_and_ps(a.v,b.v); }
+inline float4 operator|(const float4& a, const float4& b) { return _mm_or_ps(a.v,b.v); }
+// select a where mask is set and b elsewhere
+inline float4 select(const float4& mask, const float4& a, const float4& b) { return _mm_or_ps(_mm_and_ps(mask.v,a.v),_mm_andnot_ps(mask.v,b.v)); }
+#else
+#define float4_op(op, expr) inline float4 op(const float4& a, const float4& b) { float4 r; for(auto i : range(4)) r.v[i] = expr; return r; }
+#define float4_cmp(op, cmp) float4_op(op, (a.v[i] cmp b.v[i]) ? 1.0f : 0.0f)
+float4_op(operator+, a.v[i]+b.v[i])
+float4_op(operator-, a.v[i]-b.v[i])
+float4_op(operator*, a.v[i]*b.v[i])
+float4_op(operator/, a.v[i]/b.v[i])
+float4_op(min, min(a.v[i],b.v[i]))
+float4_op(max, max(a.v[i],b.v[i]))
+float4_cmp(operator<, <)
+float4_cmp(operator<=, <=)
+float4_cmp(operator>, >)
+float4_cmp(operator>=, >=)
+float4_cmp(operator!=, !=)
+float4_op(operator&, (a.v[i] and b.v[i]) ? 1.0f : 0.0f)
+float4_op(operator|, (a.v[i] or b.v[i]) ? 1.0f : 0.0f)
+#undef float4_cmp
+#undef float4_op
+// select a where mask is set and b elsewhere
+inline float4 select(const float4& mask, const float4& a, const float4& b) { float4 r; for(auto i : range(4)) r.v[i] = (mask.v[i]) ? a.v[i] : b.v[i]; return r; }
+#endif
 
 #define BVHAccelerator_min_prims 4
 #define BVHAccelerator_epsilon ray3f_epsilon
 #define BVHAccelerator_build_maxaxis false
+#define BVHAccelerator_build_sah true
+#define BVHAccelerator_sah_bins 16
+#define BVHAccelerator_sah_traversal_cost 1.0f
+#define BVHAccelerator_sah_leaf_cost 1.0f
+#define BVHAccelerator_sah_max_prims 16
+#define BVHAccelerator_build_parallel true
+#define BVHAccelerator_parallel_min_prims 4096
+
+#define BVHAccelerator_stack_size 64
+#define BVHAccelerator_sah_max_depth 32
 
-// bvh accelerator node
+// bvh accelerator node, packed in 32 bytes and stored in depth-first order,
+// so that the first child of an internal node is the node that follows it
 struct BVHNode {
-    bool leaf;      // leaf node
     range3f bbox;   // bounding box
-#ifndef _WIN32
-    union {
-        struct { int start, end; }; // for leaves: start and end primitive
-        struct { int n0, n1; };     // for internal: left and right node
-    };
-#else
-    int start, end; // for leaves: start and end primitive
-    int n0, n1;     // for internal: left and right node
-#endif
+    int start;      // for leaves: first primitive; for internal: second child
+    short count;    // for leaves: number of primitives; for internal: 0
+    short axis;     // for internal: split axis, to visit the nearest child first
+    
+    // leaf node
+    bool leaf() const { return count > 0; }
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should be 32 bytes");
+
+#define BVHAccelerator_wide true
+#define BVHAccelerator_wide_stack_size 256
+
+// a refitted bvh is rebuilt when its sah cost grows past this factor of the built one
+#define BVHAccelerator_refit_max_cost 2.0f
+
+// 4-wide bvh node, collapsed from the binary tree, with the children bounding boxes
+// stored as structure of arrays to be tested together
+struct BVHWideNode {
+    float bbox_min[3][4];   // children bounding box min, by axis
+    float bbox_max[3][4];   // children bounding box max, by axis
+    int child[4];           // for internal children: wide node; for leaves: first primitive,
+                            // or first packed triangles once packed
+    int count[4];           // for leaves: number of primitives; for internal: 0
+};
+
+// four triangles packed for intersection, as a base vertex and two edges by axis
+// (missing triangles at the end of a leaf repeat the last one)
+struct BVHTriangles4 {
+    float v2[3][4];         // base vertex
+    float a[3][4];          // edge from the base vertex to the first vertex
+    float b[3][4];          // edge from the base vertex to the second vertex
+    int prim[4];            // triangle
 };
 
 // bvh accelerator
 struct BVHAccelerator {
-    vector<int>     prims;  // sorted primitices
-    vector<BVHNode> nodes;  // bvh nodes
+    vector<int>             prims;      // sorted primitices
+    vector<BVHNode>         nodes;      // bvh nodes
+    vector<BVHWideNode>     wide_nodes; // 4-wide bvh nodes, if collapsed
+    vector<BVHTriangles4>   triangles;  // packed triangles in leaf order, for the wide bvh
+    float                   cost = 0;   // sah cost when built, to measure refit degradation
 };
 
 // split the list of nodes according to a policy
-int make_accelerator_split(vector<pair<range3f,int>>& boxed_prims, int start, int end, const range3f& bbox, bool maxaxis) {
-    auto axis = 0;
+int make_accelerator_split(vector<pair<range3f,int>>& boxed_prims, int start, int end, const range3f& bbox, bool maxaxis, int& axis) {
+    axis = 0;
     if(maxaxis) {
         auto s = size(bbox);
         if(s.x >= s.y and s.x >= s.z) axis = 0;
@@ -60,30 +182,120 @@ int make_accelerator_split(vector<pair<range3f,int>>& boxed_prims, int start, in
     return mid;
 }
 
-// recursively add a node to an accelerator
-void make_accelerator_node(int nodeid,
-                           vector<pair<range3f,int>>& boxed_prims,
+// surface area of a bounding box
+inline float bbox_area(const range3f& bbox) {
+    auto s = size(bbox);
+    return 2*(s.x*s.y+s.y*s.z+s.z*s.x);
+}
+
+// split the list of nodes by the surface area heuristic, evaluated at the boundaries
+// of BVHAccelerator_sah_bins bins along each axis of the primitive centers; returns -1
+// if keeping the primitives in a leaf is cheaper than any split
+int make_accelerator_split_sah(vector<pair<range3f,int>>& boxed_prims, int start, int end, const range3f& bbox, int& axis) {
+    // bound primitive centers
+    auto cbbox = range3f();
+    for(auto i : range(start,end)) cbbox = runion(cbbox,center(boxed_prims[i].first));
+    auto csize = size(cbbox);
+    
+    // bin index of a primitive along an axis
+    const auto nbins = BVHAccelerator_sah_bins;
+    auto bin = [&cbbox,&csize,nbins](const pair<range3f,int>& prim, int axis) {
+        return min(nbins-1, (int)(nbins * (center(prim.first)[axis] - cbbox.min[axis]) / csize[axis]));
+    };
+    
+    // find the cheapest split among all axes and bin boundaries
+    auto nprims = end-start;
+    auto best_cost = 0.0f;
+    auto best_axis = -1, best_bin = 0;
+    for(auto a : range(3)) {
+        if(csize[a] <= 0) continue;
+        // bin primitives
+        range3f bin_bbox[nbins]; int bin_count[nbins] = { 0 };
+        for(auto i : range(start,end)) {
+            auto b = bin(boxed_prims[i],a);
+            bin_bbox[b] = runion(bin_bbox[b],boxed_prims[i].first);
+            bin_count[b] ++;
+        }
+        // sweep from the right to compute the area and count right of each boundary
+        float right_area[nbins]; int right_count[nbins];
+        auto right_bbox = range3f(); auto count = 0;
+        for(auto b = nbins-1; b > 0; b --) {
+            right_bbox = runion(right_bbox,bin_bbox[b]); count += bin_count[b];
+            right_area[b] = (count) ? bbox_area(right_bbox) : 0; right_count[b] = count;
+        }
+        // sweep from the left evaluating the cost of each boundary
+        auto left_bbox = range3f(); count = 0;
+        for(auto b : range(1,nbins)) {
+            left_bbox = runion(left_bbox,bin_bbox[b-1]); count += bin_count[b-1];
+            if(not count or not right_count[b]) continue;
+            auto cost = BVHAccelerator_sah_traversal_cost + BVHAccelerator_sah_leaf_cost *
+                (count*bbox_area(left_bbox) + right_count[b]*right_area[b]) / bbox_area(bbox);
+            if(best_axis < 0 or cost < best_cost) { best_cost = cost; best_axis = a; best_bin = b; }
+        }
+    }
+    
+    // make a leaf if cheaper than splitting and not too large
+    if(nprims <= BVHAccelerator_sah_max_prims and
+       (best_axis < 0 or best_cost >= BVHAccelerator_sah_leaf_cost * nprims)) return -1;
+    // split in half if all centers coincide
+    axis = max(0, best_axis);
+    if(best_axis < 0) return (start+end)/2;
+    // partition primitives at the best boundary
+    return std::partition(boxed_prims.begin()+start,boxed_prims.begin()+end,
+                          [&bin,best_axis,best_bin](const pair<range3f,int>& prim) {
+                              return bin(prim,best_axis) < best_bin; }) - boxed_prims.begin();
+}
+
+// append the nodes of a subtree built on its own, returning the index of its root
+int append_accelerator_nodes(vector<BVHNode>& nodes, const vector<BVHNode>& subtree) {
+    auto offset = (int)nodes.size();
+    for(auto node : subtree) {
+        if(not node.leaf()) node.start += offset;
+        nodes.push_back(node);
+    }
+    return offset;
+}
+
+// recursively add a node, followed by its subtree in depth-first order, to an accelerator;
+// with more than one task available, large subtrees are built concurrently, splitting the
+// tasks between them; below BVHAccelerator_sah_max_depth, median splits keep the tree
+// shallow enough for the traversal stack
+void make_accelerator_node(vector<pair<range3f,int>>& boxed_prims,
                            vector<BVHNode>& nodes,
-                           int start, int end) {
+                           int start, int end, int depth, int ntasks) {
     range3f bbox;
     auto node = BVHNode();
     for(auto i : range(start, end)) bbox = runion(bbox,boxed_prims[i].first);
-    if(end-start <= BVHAccelerator_min_prims) {
-        node.bbox = bbox;
-        node.leaf = true;
+    auto middle = -1, axis = 0;
+    if(end-start > BVHAccelerator_min_prims) {
+        if(BVHAccelerator_build_sah and depth < BVHAccelerator_sah_max_depth) middle = make_accelerator_split_sah(boxed_prims,start,end,bbox,axis);
+        else middle = make_accelerator_split(boxed_prims,start,end,bbox,BVHAccelerator_build_maxaxis,axis);
+    }
+    auto nodeid = (int)nodes.size();
+    nodes.push_back(BVHNode());
+    node.bbox = bbox;
+    if(middle < 0) {
         node.start = start;
-        node.end = end;
+        node.count = end-start;
+        node.axis = 0;
+    } else if(BVHAccelerator_build_parallel and ntasks > 1 and end-start >= BVHAccelerator_parallel_min_prims) {
+        node.count = 0;
+        node.axis = axis;
+        // build the children into their own node lists, the first one in a separate task,
+        // then append them (the children primitive ranges are disjoint)
+        auto nodes0 = vector<BVHNode>(), nodes1 = vector<BVHNode>();
+        auto task = std::async(std::launch::async, [&](){
+            make_accelerator_node(boxed_prims,nodes0,start,middle,depth+1,ntasks/2); });
+        make_accelerator_node(boxed_prims,nodes1,middle,end,depth+1,ntasks-ntasks/2);
+        task.wait();
+        append_accelerator_nodes(nodes, nodes0);
+        node.start = append_accelerator_nodes(nodes, nodes1);
     } else {
-        int middle = make_accelerator_split(boxed_prims,start,end,bbox,BVHAccelerator_build_maxaxis);
-        node.bbox = bbox;
-        node.leaf = false;
-        nodes.push_back(BVHNode());
-        node.n0 = nodes.size();
-        nodes.push_back(BVHNode());
-        node.n1 = nodes.size();
-        nodes.push_back(BVHNode());
-        make_accelerator_node(node.n0,boxed_prims,nodes,start,middle);
-        make_accelerator_node(node.n1,boxed_prims,nodes,middle,end);
+        node.count = 0;
+        node.axis = axis;
+        make_accelerator_node(boxed_prims,nodes,start,middle,depth+1,ntasks);
+        node.start = nodes.size();
+        make_accelerator_node(boxed_prims,nodes,middle,end,depth+1,ntasks);
     }
     nodes[nodeid] = node;
 }
@@ -108,6 +320,20 @@ inline bool intersect_bbox(const ray3f& ray, const range3f& bbox) {
     float t0, t1; return intersect_bbox(ray,bbox,t0,t1);
 }
 
+// intersect bounding box with precomputed inverse ray direction
+inline bool intersect_bbox(const ray3f& ray, const vec3f& inv_d, const range3f& bbox) {
+    auto t0 = ray.tmin, t1 = ray.tmax;
+    for (int i = 0; i < 3; ++i) {
+        auto tNear = (bbox.min[i] - ray.e[i]) * inv_d[i];
+        auto tFar  = (bbox.max[i] - ray.e[i]) * inv_d[i];
+        if (tNear > tFar) std::swap(tNear, tFar);
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar  < t1 ? tFar  : t1;
+        if (t0 > t1) return false;
+    }
+    return true;
+}
+
 // intersect triangle
 inline bool intersect_triangle(const ray3f& ray, const vec3f& v0, const vec3f& v1, const vec3f& v2, float& t, float& ba, float& bb) {
     auto a = v0 - v2;
@@ -165,306 +391,1204 @@ inline bool intersect_quad(const ray3f& ray, float radius) {
     float t; vec3f p; return intersect_quad(ray, radius, t, p);
 }
 
-// intersect an accelerator
+// intersect an accelerator, iteratively visiting the child nearest to the ray first
+// and skipping nodes beyond the closest hit found so far; intersect_elem sets the ray
+// parameter of the hits, that shorten the ray; returns whether any primitive was hit
 template<typename intersect_func>
-intersection3f intersect(BVHAccelerator* bvh, int nodeid, const ray3f& ray,
-                         const intersect_func& intersect_elem) {
-    // grab node
-    auto& node = bvh->nodes[nodeid];
-    // intersect bbox
-    if(not intersect_bbox(ray, node.bbox)) return intersection3f();
-    // recursively intersect nodes
-    intersection3f intersection;
+bool intersect(BVHAccelerator* bvh, const ray3f& ray, const intersect_func& intersect_elem) {
+    auto hit = false;
     // copy the ray to allow for shortening it
     auto sray = ray;
-    if(node.leaf) {
-        for(int idx = node.start; idx < node.end; idx ++) {
-            auto i = bvh->prims[idx];
-            intersection3f sintersection = intersect_elem(i,sray);
-            if(not sintersection.hit) continue;
-            if(sintersection.ray_t > intersection.ray_t and intersection.hit) continue;
-            intersection = sintersection;
-            sray.tmax = intersection.ray_t;
-        }
-    } else {
-        for(auto n : { node.n0, node.n1 }) {
-            intersection3f sintersection = intersect(bvh,n,sray,intersect_elem);
-            if(not sintersection.hit) continue;
-            if(sintersection.ray_t > intersection.ray_t and intersection.hit) continue;
-            intersection = sintersection;
-            sray.tmax = intersection.ray_t;
+    auto inv_d = vec3f(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+    // nodes left to visit
+    int stack[BVHAccelerator_stack_size];
+    auto stack_size = 0;
+    stack[stack_size++] = 0;
+    while(stack_size) {
+        // grab node and intersect bbox
+        auto& node = bvh->nodes[stack[--stack_size]];
+        if(not intersect_bbox(sray, inv_d, node.bbox)) continue;
+        if(node.leaf()) {
+            for(int idx = node.start; idx < node.start + node.count; idx ++) {
+                auto t = 0.0f;
+                if(not intersect_elem(bvh->prims[idx],sray,t)) continue;
+                hit = true;
+                sray.tmax = t;
+            }
+        } else {
+            // push the far child first, so that the near one is visited next
+            auto nodeid = (int)(&node - bvh->nodes.data());
+            if(ray.d[node.axis] < 0) { stack[stack_size++] = nodeid+1; stack[stack_size++] = node.start; }
+            else { stack[stack_size++] = node.start; stack[stack_size++] = nodeid+1; }
         }
     }
-    return intersection;
+    return hit;
+}
+
+// intersect an accelerator, returning the closest primitive hit with its ray parameter
+// and barycentric coordinates
+template<typename intersect_func>
+bool intersect(BVHAccelerator* bvh, const ray3f& ray,
+               const intersect_func& intersect_elem, int& prim, float& t, float& u, float& v) {
+    return intersect(bvh, ray, [&](int i, const ray3f& sray, float& st){
+        auto su = 0.0f, sv = 0.0f;
+        if(not intersect_elem(i,sray,st,su,sv)) return false;
+        prim = i; t = st; u = su; v = sv;
+        return true;
+    });
 }
 
-// intersect an accelerator
+// intersect an accelerator, iteratively visiting the child nearest to the ray first
 template<typename intersect_func>
-bool intersect_shadow(BVHAccelerator* bvh, int nodeid, const ray3f& ray,
+bool intersect_shadow(BVHAccelerator* bvh, const ray3f& ray,
                       const intersect_func& intersect_elem_shadow) {
-    // grab node
-    auto& node = bvh->nodes[nodeid];
-    // intersect bbox
-    if(not intersect_bbox(ray, node.bbox)) return false;
-    // recursively intersect nodes
-    if(node.leaf) {
-        // for(auto idx : range(node.start,node.end)) {
-        for(int idx = node.start; idx < node.end; idx++) {
-            auto i = bvh->prims[idx];
-            if(intersect_elem_shadow(i,ray)) return true;
+    auto inv_d = vec3f(1/ray.d.x, 1/ray.d.y, 1/ray.d.z);
+    // nodes left to visit
+    int stack[BVHAccelerator_stack_size];
+    auto stack_size = 0;
+    stack[stack_size++] = 0;
+    while(stack_size) {
+        // grab node and intersect bbox
+        auto& node = bvh->nodes[stack[--stack_size]];
+        if(not intersect_bbox(ray, inv_d, node.bbox)) continue;
+        if(node.leaf()) {
+            for(int idx = node.start; idx < node.start + node.count; idx ++) {
+                auto i = bvh->prims[idx];
+                if(intersect_elem_shadow(i,ray)) return true;
+            }
+        } else {
+            // push the far child first, so that the near one is visited next
+            auto nodeid = (int)(&node - bvh->nodes.data());
+            if(ray.d[node.axis] < 0) { stack[stack_size++] = nodeid+1; stack[stack_size++] = node.start; }
+            else { stack[stack_size++] = node.start; stack[stack_size++] = nodeid+1; }
         }
-    } else {
-        if(intersect_shadow(bvh,node.n0,ray,intersect_elem_shadow)) return true;
-        if(intersect_shadow(bvh,node.n1,ray,intersect_elem_shadow)) return true;
     }
     return false;
 }
 
-// build accelerator
-BVHAccelerator* make_accelerator(vector<range3f>& bboxes) {
+// collapse the binary subtree rooted at nodeid into 4-wide nodes, opening the internal
+// child with the largest surface area until four children are gathered; returns the
+// index of the wide node
+int make_accelerator_wide_node(BVHAccelerator* bvh, int nodeid) {
+    // gather children
+    auto children = vector<int>{ nodeid+1, bvh->nodes[nodeid].start };
+    while(children.size() < 4) {
+        auto best = -1; auto best_area = 0.0f;
+        for(auto c : range(children.size())) {
+            auto& child = bvh->nodes[children[c]];
+            if(child.leaf()) continue;
+            if(best < 0 or bbox_area(child.bbox) > best_area) { best = c; best_area = bbox_area(child.bbox); }
+        }
+        if(best < 0) break;
+        auto open = children[best];
+        children[best] = open+1;
+        children.push_back(bvh->nodes[open].start);
+    }
+    // set up the wide node, recursively collapsing internal children
+    auto wideid = (int)bvh->wide_nodes.size();
+    bvh->wide_nodes.push_back(BVHWideNode());
+    auto wide = BVHWideNode();
+    for(auto c : range(4)) {
+        if(c >= (int)children.size()) {
+            // empty slots hold a degenerate box far away, missed by all rays
+            for(auto a : range(3)) wide.bbox_min[a][c] = wide.bbox_max[a][c] = 1e30f;
+            wide.child[c] = 0; wide.count[c] = 0;
+            continue;
+        }
+        auto& child = bvh->nodes[children[c]];
+        for(auto a : range(3)) { wide.bbox_min[a][c] = child.bbox.min[a]; wide.bbox_max[a][c] = child.bbox.max[a]; }
+        if(child.leaf()) { wide.child[c] = child.start; wide.count[c] = child.count; }
+        else { wide.child[c] = make_accelerator_wide_node(bvh, children[c]); wide.count[c] = 0; }
+    }
+    bvh->wide_nodes[wideid] = wide;
+    return wideid;
+}
+
+// pack the triangles of a mesh accelerated by a wide bvh in groups of four, in the order
+// the leaves are stored, and point the leaves to their groups
+void make_accelerator_triangles(Mesh* mesh) {
+    auto bvh = mesh->bvh;
+    for(auto& node : bvh->wide_nodes) {
+        for(auto c : range(4)) {
+            if(not node.count[c]) continue;
+            auto start = node.child[c], end = start + node.count[c];
+            node.child[c] = bvh->triangles.size();
+            for(auto idx = start; idx < end; idx += 4) {
+                auto group = BVHTriangles4();
+                for(auto k : range(4)) {
+                    auto prim = bvh->prims[min(idx+k,end-1)];
+                    auto triangle = mesh->triangle[prim];
+                    auto v0 = mesh->pos[triangle.x], v1 = mesh->pos[triangle.y], v2 = mesh->pos[triangle.z];
+                    auto a = v0 - v2, b = v1 - v2;
+                    for(auto i : range(3)) { group.v2[i][k] = v2[i]; group.a[i][k] = a[i]; group.b[i][k] = b[i]; }
+                    group.prim[k] = prim;
+                }
+                bvh->triangles.push_back(group);
+            }
+        }
+    }
+}
+
+// sah cost of an accelerator, relative to its root area, used as its quality metric
+float accelerator_cost(BVHAccelerator* bvh) {
+    auto cost = 0.0f;
+    for(auto& node : bvh->nodes) {
+        if(node.leaf()) cost += BVHAccelerator_sah_leaf_cost * node.count * bbox_area(node.bbox);
+        else cost += BVHAccelerator_sah_traversal_cost * bbox_area(node.bbox);
+    }
+    auto area = bbox_area(bvh->nodes[0].bbox);
+    return (area > 0) ? cost / area : 0;
+}
+
+// build accelerator, using up to ntasks concurrent tasks, and collapse it
+// into a wide accelerator if requested
+BVHAccelerator* make_accelerator(vector<range3f>& bboxes, int ntasks, bool wide) {
     vector<pair<range3f,int>> boxed_prims(bboxes.size());
     for(auto i : range(bboxes.size())) boxed_prims[i] = pair<range3f,int>(rscale(bboxes[i],1+BVHAccelerator_epsilon),i);
     auto bvh = new BVHAccelerator();
-    bvh->nodes.push_back(BVHNode());
-    make_accelerator_node(0, boxed_prims, bvh->nodes, 0, bboxes.size());
-    bvh->prims.reserve(bboxes.size());
+    make_accelerator_node(boxed_prims, bvh->nodes, 0, bboxes.size(), 0, ntasks);
+    bvh->prims.resize(bboxes.size());
     for(auto i : range(boxed_prims.size())) bvh->prims[i] = boxed_prims[i].second;
+    if(wide and not bvh->nodes[0].leaf()) make_accelerator_wide_node(bvh, 0);
+    bvh->cost = accelerator_cost(bvh);
     return bvh;
 }
 
-// intersects the scene and return the first intrerseciton
-intersection3f intersect(Scene* scene, ray3f ray) {
+// build a mesh accelerator, using up to ntasks concurrent tasks
+void make_mesh_accelerator(Mesh* mesh, int ntasks) {
+    // grab all bbox
+    auto bboxes = vector<range3f>(mesh->triangle.size());
+    for(auto i : range(mesh->triangle.size())) {
+        auto f = mesh->triangle[i];
+        bboxes[i] = make_range3f({mesh->pos[f.x],mesh->pos[f.y],mesh->pos[f.z]});
+    }
+    // make accelerator
+    mesh->bvh = make_accelerator(bboxes, ntasks, BVHAccelerator_wide);
+    // pack triangles for the wide bvh
+    if(not mesh->bvh->wide_nodes.empty()) make_accelerator_triangles(mesh);
+}
+
+// refit the bounding boxes of the subtree rooted at nodeid to the mesh vertices,
+// bottom-up, refitting the first child in a separate task while ntasks allows
+range3f refit_accelerator_node(Mesh* mesh, int nodeid, int ntasks) {
+    auto bvh = mesh->bvh;
+    auto& node = bvh->nodes[nodeid];
+    auto bbox = range3f();
+    if(node.leaf()) {
+        for(auto idx : range(node.start, node.start + node.count)) {
+            auto f = mesh->triangle[bvh->prims[idx]];
+            bbox = runion(bbox,rscale(make_range3f({mesh->pos[f.x],mesh->pos[f.y],mesh->pos[f.z]}),1+BVHAccelerator_epsilon));
+        }
+    } else if(BVHAccelerator_build_parallel and ntasks > 1) {
+        auto task = std::async(std::launch::async, [&](){ return refit_accelerator_node(mesh, nodeid+1, ntasks/2); });
+        bbox = refit_accelerator_node(mesh, node.start, ntasks-ntasks/2);
+        bbox = runion(task.get(), bbox);
+    } else {
+        bbox = runion(refit_accelerator_node(mesh, nodeid+1, ntasks), refit_accelerator_node(mesh, node.start, ntasks));
+    }
+    node.bbox = bbox;
+    return bbox;
+}
+
+// refit a mesh accelerator to its moved vertices, keeping its topology, and collapse
+// it again if wide; returns false if its quality degraded so that it should be rebuilt
+bool refit_accelerator(Mesh* mesh, int ntasks) {
+    auto bvh = mesh->bvh;
+    refit_accelerator_node(mesh, 0, ntasks);
+    if(accelerator_cost(bvh) > BVHAccelerator_refit_max_cost * bvh->cost) return false;
+    if(not bvh->wide_nodes.empty()) {
+        bvh->wide_nodes.clear();
+        bvh->triangles.clear();
+        make_accelerator_wide_node(bvh, 0);
+        make_accelerator_triangles(mesh);
+    }
+    return true;
+}
+
+// intersect a ray with four packed triangles at once, returning the mask of triangles hit
+// and their ray parameters and barycentric coordinates (same test as intersect_triangle)
+inline int intersect_triangles4(const ray3f& ray, const BVHTriangles4& triangles,
+                                float4& t, float4& ba, float4& bb) {
+    float4 v2[3] = { float4(triangles.v2[0]), float4(triangles.v2[1]), float4(triangles.v2[2]) };
+    float4 a[3] = { float4(triangles.a[0]), float4(triangles.a[1]), float4(triangles.a[2]) };
+    float4 b[3] = { float4(triangles.b[0]), float4(triangles.b[1]), float4(triangles.b[2]) };
+    float4 e[3] = { float4(ray.e.x) - v2[0], float4(ray.e.y) - v2[1], float4(ray.e.z) - v2[2] };
+    float4 i[3] = { float4(ray.d.x), float4(ray.d.y), float4(ray.d.z) };
+    
+    // cross(i,b), cross(e,a) and cross(a,i)
+    float4 ib[3] = { i[1]*b[2] - i[2]*b[1], i[2]*b[0] - i[0]*b[2], i[0]*b[1] - i[1]*b[0] };
+    float4 ea[3] = { e[1]*a[2] - e[2]*a[1], e[2]*a[0] - e[0]*a[2], e[0]*a[1] - e[1]*a[0] };
+    float4 ai[3] = { a[1]*i[2] - a[2]*i[1], a[2]*i[0] - a[0]*i[2], a[0]*i[1] - a[1]*i[0] };
+    
+    auto d = ib[0]*a[0] + ib[1]*a[1] + ib[2]*a[2];
+    t = (ea[0]*b[0] + ea[1]*b[1] + ea[2]*b[2]) / d;
+    ba = (ib[0]*e[0] + ib[1]*e[1] + ib[2]*e[2]) / d;
+    bb = (ai[0]*e[0] + ai[1]*e[1] + ai[2]*e[2]) / d;
+    
+    auto hit = (d != float4(0.0f)) & (t >= float4(ray.tmin)) & (t <= float4(ray.tmax)) &
+               (ba >= float4(0.0f)) & (bb >= float4(0.0f)) & (ba + bb <= float4(1));
+    return hit.mask();
+}
+
+// intersect a ray with the four children bounding boxes of a wide node, returning the mask
+// of children hit and their entry distances
+inline int intersect_bbox4(const BVHWideNode& node, const float4 e[3], const float4 inv_d[3],
+                           float tmin, float tmax, float4& tnear) {
+    auto t0 = float4(tmin), t1 = float4(tmax);
+    for(auto a : range(3)) {
+        auto tn = (float4(node.bbox_min[a]) - e[a]) * inv_d[a];
+        auto tf = (float4(node.bbox_max[a]) - e[a]) * inv_d[a];
+        t0 = max(t0, min(tn, tf));
+        t1 = min(t1, max(tn, tf));
+    }
+    tnear = t0;
+    return (t0 <= t1).mask();
+}
+
+// intersect a mesh 4-wide accelerator, visiting children nearest first and testing leaf
+// triangles four at a time; returns the closest triangle hit, or any hit for shadows
+template<bool shadow>
+bool intersect_wide(Mesh* mesh, const ray3f& ray, int& tid, float& t, float& u, float& v) {
+    auto bvh = mesh->bvh;
+    auto hit = false;
+    // copy the ray to allow for shortening it
+    auto sray = ray;
+    float4 e[3] = { float4(ray.e.x), float4(ray.e.y), float4(ray.e.z) };
+    float4 inv_d[3] = { float4(1/ray.d.x), float4(1/ray.d.y), float4(1/ray.d.z) };
+    // entries left to visit, as wide nodes or as leaves (encoded as -1-slot), with their distance
+    int stack[BVHAccelerator_wide_stack_size];
+    float stack_t[BVHAccelerator_wide_stack_size];
+    auto stack_size = 0;
+    stack[stack_size] = 0; stack_t[stack_size++] = ray.tmin;
+    while(stack_size) {
+        stack_size --;
+        auto entry = stack[stack_size];
+        // skip entries beyond the closest hit
+        if(stack_t[stack_size] > sray.tmax) continue;
+        if(entry < 0) {
+            // intersect leaf triangles, streaming through their packed groups of four
+            auto& leaf = bvh->wide_nodes[(-1-entry)/4];
+            auto start = leaf.child[(-1-entry)%4], end = start + (leaf.count[(-1-entry)%4]+3)/4;
+            for(auto idx = start; idx < end; idx ++) {
+                auto& triangles = bvh->triangles[idx];
+                auto tt = float4(), tu = float4(), tv = float4();
+                auto mask = intersect_triangles4(sray, triangles, tt, tu, tv);
+                if(not mask) continue;
+                if(shadow) return true;
+                // keep the closest hit
+                float ts[4], us[4], vs[4]; tt.store(ts); tu.store(us); tv.store(vs);
+                for(auto k : range(4)) {
+                    if(not (mask & (1 << k)) or ts[k] > sray.tmax) continue;
+                    hit = true; sray.tmax = t = ts[k]; u = us[k]; v = vs[k];
+                    tid = triangles.prim[k];
+                }
+            }
+            continue;
+        }
+        // intersect children bounds
+        auto& node = bvh->wide_nodes[entry];
+        auto tnear = float4();
+        auto mask = intersect_bbox4(node, e, inv_d, sray.tmin, sray.tmax, tnear);
+        if(not mask) continue;
+        float ts[4]; tnear.store(ts);
+        // sort the children hit by decreasing distance, and push them so that the nearest is visited next
+        int order[4]; auto count = 0;
+        for(auto c : range(4)) {
+            if(not (mask & (1 << c))) continue;
+            auto pos = count++;
+            while(pos > 0 and ts[order[pos-1]] < ts[c]) { order[pos] = order[pos-1]; pos --; }
+            order[pos] = c;
+        }
+        for(auto k : range(count)) {
+            auto c = order[k];
+            stack[stack_size] = (node.count[c]) ? -1-(entry*4+c) : node.child[c];
+            stack_t[stack_size++] = ts[c];
+        }
+    }
+    return hit;
+}
+
+// frame kinds, cached in the objects by accelerate, so that the common identity and
+// translation frames skip the rotation when transforming rays and hits
+#define frame_kind_general 0
+#define frame_kind_identity 1
+#define frame_kind_translation 2
+
+// classify a frame by the transform fast path it allows
+inline int frame_kind(const frame3f& f) {
+    if(not (f.x == x3f and f.y == y3f and f.z == z3f)) return frame_kind_general;
+    return (f.o == zero3f) ? frame_kind_identity : frame_kind_translation;
+}
+
+// transform a ray by a frame inverse, by the fast path of the frame kind
+inline ray3f transform_ray_inverse(const frame3f& f, int kind, const ray3f& ray) {
+    if(kind == frame_kind_identity) return ray;
+    if(kind == frame_kind_translation) return ray3f(ray.e - f.o, ray.d, ray.tmin, ray.tmax);
+    return transform_ray_inverse(f, ray);
+}
+
+// transform a point by a frame, by the fast path of the frame kind
+inline vec3f transform_point(const frame3f& f, int kind, const vec3f& p) {
+    if(kind == frame_kind_identity) return p;
+    if(kind == frame_kind_translation) return f.o + p;
+    return transform_point(f, p);
+}
+
+// transform a normal by a frame, by the fast path of the frame kind
+inline vec3f transform_normal(const frame3f& f, int kind, const vec3f& n) {
+    return (kind == frame_kind_general) ? transform_normal(f, n) : n;
+}
+
+// closest hit found while traversing the scene, recording only what identifies it;
+// the hit attributes are computed once for the final hit by make_intersection
+struct HitRecord {
+    float   t = 0;          // ray parameter
+    float   u = 0, v = 0;   // barycentric coordinates, for triangles
+    int     prim = -1;      // triangle, for meshes, or surface index
+    int     mesh = -1;      // mesh index, or -1 for surfaces
+    
+    // whether it hits something
+    bool hit() const { return prim >= 0; }
+};
+
+// intersects a surface, updating the record if the hit is the closest so far
+bool intersect_surface(Scene* scene, int sid, const ray3f& ray, HitRecord& record) {
+    auto surface = scene->surfaces[sid];
+    // compute ray intersection (and ray parameter), continue if not hit
+    auto tray = transform_ray_inverse(surface->frame,surface->_frame_kind,ray);
+    auto t = 0.0f; auto p = zero3f;
+    // if it is a quad, intersect quad, else intersect sphere
+    auto hit = (surface->isquad) ? intersect_quad(tray, surface->radius, t, p) : intersect_sphere(tray, surface->radius, t);
+    // skip if not hit
+    if(not hit) return false;
+    // check if this is the closest intersection, continue if not
+    if(t > record.t and record.hit()) return false;
+    // record the hit
+    record.t = t; record.prim = sid; record.mesh = -1;
+    return true;
+}
+
+// intersects a mesh, updating the record if the hit is the closest so far
+bool intersect_mesh(Scene* scene, int mid, const ray3f& ray, HitRecord& record) {
+    // grab the instance frame and the shared geometry
+    auto instance = scene->meshes[mid];
+    auto mesh = mesh_shape(instance);
+    // quads are not supported: check for error
+    error_if_not(mesh->quad.empty(), "quad intersection is not supported");
+    // tranform the ray, shortened to the closest hit so far
+    auto tray = transform_ray_inverse(instance->frame, instance->_frame_kind, ray);
+    if(record.hit()) tray.tmax = record.t;
+    // closest triangle hit
+    auto tid = -1; auto t = 0.0f, u = 0.0f, v = 0.0f;
+    // if it is accelerated by a wide bvh
+    if(mesh->bvh and not mesh->bvh->wide_nodes.empty()) {
+        if(not intersect_wide<false>(mesh, tray, tid, t, u, v)) return false;
+    }
+    // if it is accelerated
+    else if(mesh->bvh) {
+        auto hit = intersect(mesh->bvh, tray,
+           [mesh](int tid, const ray3f& tray, float& t, float& u, float& v){
+               // grab triangle
+               auto triangle = mesh->triangle[tid];
+               
+               // intersect triangle
+               return intersect_triangle(tray, mesh->pos[triangle.x], mesh->pos[triangle.y], mesh->pos[triangle.z], t, u, v);
+           }, tid, t, u, v);
+        if(not hit) return false;
+    } else {
+        // foreach triangle
+        for(auto i : range(mesh->triangle.size())) {
+            auto triangle = mesh->triangle[i];
+            // intersect triangle, shortening the ray
+            auto tt = 0.0f, tu = 0.0f, tv = 0.0f;
+            if(not intersect_triangle(tray, mesh->pos[triangle.x], mesh->pos[triangle.y], mesh->pos[triangle.z], tt, tu, tv)) continue;
+            tid = i; t = tt; u = tu; v = tv;
+            tray.tmax = t;
+        }
+        if(tid < 0) return false;
+    }
+    // record the hit
+    record.t = t; record.u = u; record.v = v; record.prim = tid; record.mesh = mid;
+    return true;
+}
+
+// intersects an object of the scene, i.e. the surfaces followed by the meshes,
+// updating the record if the hit is the closest so far
+inline bool intersect_object(Scene* scene, int oid, const ray3f& ray, HitRecord& record) {
+    auto nsurfaces = (int)scene->surfaces.size();
+    if(oid < nsurfaces) return intersect_surface(scene, oid, ray, record);
+    else return intersect_mesh(scene, oid - nsurfaces, ray, record);
+}
+
+// set up the intersection for the closest hit, computing its position, normal,
+// texture coordinates and material, in world space
+intersection3f make_intersection(Scene* scene, const ray3f& ray, const HitRecord& record) {
     // create a default intersection record to be returned
     auto intersection = intersection3f();
-    // foreach surface
-    for(auto surface : scene->surfaces) {
+    if(not record.hit()) return intersection;
+    intersection.hit = true;
+    intersection.ray_t = record.t;
+    // if it is a surface
+    if(record.mesh < 0) {
+        auto surface = scene->surfaces[record.prim];
+        // compute local point
+        auto tray = transform_ray_inverse(surface->frame,surface->_frame_kind,ray);
+        auto p = tray.eval(record.t);
         // if it is a quad
         if(surface->isquad) {
-            // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
-            
-            // intersect quad
-            auto t = 0.0f; auto p = zero3f;
-            auto hit = intersect_quad(tray, surface->radius, t, p);
-            
-            // skip if not hit
-            if(not hit) continue;
-            
-            // check if this is the closest intersection, continue if not
-            if(t > intersection.ray_t and intersection.hit) continue;
-            
-            // if hit, set intersection record values
-            intersection.hit = true;
-            intersection.ray_t = t;
-            intersection.pos = transform_point(surface->frame,p);
-            intersection.norm = transform_normal(surface->frame,z3f);
+            intersection.pos = transform_point(surface->frame,surface->_frame_kind,p);
+            intersection.norm = transform_normal(surface->frame,surface->_frame_kind,z3f);
             intersection.texcoord = {0.5f*p.x/surface->radius+0.5f,0.5f*p.y/surface->radius+0.5f};
-            intersection.mat = surface->mat;
+            intersection.texcoord_scale = 0.5f/surface->radius;
         } else {
-            // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
-            
-            // intersect sphere
-            auto t = 0.0f;
-            auto hit = intersect_sphere(tray, surface->radius, t);
-            
-            // skip if not hit
-            if(not hit) continue;
-            
-            // check if this is the closest intersection, continue if not
-            if(t > intersection.ray_t and intersection.hit) continue;
-            
-            // compute local point and normal
-            auto p = tray.eval(t);
+            // compute local normal
             auto n = normalize(p);
-            
-            // if hit, set intersection record values
-            intersection.hit = true;
-            intersection.ray_t = t;
-            intersection.pos = transform_point(surface->frame,p);
-            intersection.norm = transform_normal(surface->frame,n);
+            intersection.pos = transform_point(surface->frame,surface->_frame_kind,p);
+            intersection.norm = transform_normal(surface->frame,surface->_frame_kind,n);
             intersection.texcoord = {(pif+(float)atan2(n.y, n.x))/(2*pif),(float)acos(n.z)/pif};
-            intersection.mat = surface->mat;
+            intersection.texcoord_scale = 1/(pif*surface->radius);
         }
-    }
-    // foreach mesh
-    for(auto mesh : scene->meshes) {
-        // quads are not supported: check for error
-        error_if_not(mesh->quad.empty(), "quad intersection is not supported");
-        // tranform the ray
-        auto tray = transform_ray_inverse(mesh->frame, ray);
-        // save auto mesh intersection
-        auto sintersection = intersection3f();
-        // if it is accelerated
-        if(mesh->bvh) {
-            sintersection = intersect(mesh->bvh, 0, tray,
-               [mesh](int tid, ray3f tray){
-                   // grab triangle
-                   auto triangle = mesh->triangle[tid];
-                   
-                   // grab vertices
-                   auto v0 = mesh->pos[triangle.x];
-                   auto v1 = mesh->pos[triangle.y];
-                   auto v2 = mesh->pos[triangle.z];
-                   
-                   // intersect triangle
-                   auto t = 0.0f, u = 0.0f, v = 0.0f;
-                   auto hit = intersect_triangle(tray, v0, v1, v2, t, u, v);
-                   
-                   // skip if not hit
-                   if(not hit) return intersection3f();
-                   
-                   // if hit, set up intersection, trasforming hit data to world space
-                   auto sintersection = intersection3f();
-                   sintersection.hit = true;
-                   sintersection.ray_t = t;
-                   sintersection.pos = tray.eval(t);
-                   sintersection.norm = normalize(mesh->norm[triangle.x]*u+
-                                                  mesh->norm[triangle.y]*v+
-                                                  mesh->norm[triangle.z]*(1-u-v));
-                   if(mesh->texcoord.empty()) sintersection.texcoord = zero2f;
-                   else {
-                       sintersection.texcoord = mesh->texcoord[triangle.x]*u+
-                                                mesh->texcoord[triangle.y]*v+
-                                                mesh->texcoord[triangle.z]*(1-u-v);
-                   }
-                   sintersection.mat = mesh->mat;
-                   return sintersection;
-               });
-        } else {
-            // clear intersection
-            sintersection = intersection3f();
-            // foreach triangle
-            for(auto triangle : mesh->triangle) {
-                // grab vertices
-                auto v0 = mesh->pos[triangle.x];
-                auto v1 = mesh->pos[triangle.y];
-                auto v2 = mesh->pos[triangle.z];
-                
-                // intersect triangle
-                auto t = 0.0f, u = 0.0f, v = 0.0f;
-                auto hit = intersect_triangle(tray, v0, v1, v2, t, u, v);
-                
-                // skip if not hit
-                if(not hit) continue;
-                
-                // check if closer then the found hit
-                if(t > sintersection.ray_t and sintersection.hit) continue;
-                
-                // if hit, set up intersection, trasforming hit data to world space
-                sintersection.hit = true;
-                sintersection.ray_t = t;
-                sintersection.pos = tray.eval(t);
-                sintersection.norm = normalize(mesh->norm[triangle.x]*u+
-                                               mesh->norm[triangle.y]*v+
-                                               mesh->norm[triangle.z]*(1-u-v));
-                if(mesh->texcoord.empty()) sintersection.texcoord = zero2f;
-                else {
-                    sintersection.texcoord = mesh->texcoord[triangle.x]*u+
-                                             mesh->texcoord[triangle.y]*v+
-                                             mesh->texcoord[triangle.z]*(1-u-v);
-                }
-                sintersection.mat = mesh->mat;
-            }
+        intersection.mat = surface->mat;
+        intersection.emitter = surface->_emitter;
+    } else {
+        auto instance = scene->meshes[record.mesh];
+        auto mesh = mesh_shape(instance);
+        auto triangle = mesh->triangle[record.prim];
+        auto u = record.u, v = record.v;
+        // interpolate triangle attributes, trasforming hit data to world space
+        auto tray = transform_ray_inverse(instance->frame, instance->_frame_kind, ray);
+        intersection.pos = transform_point(instance->frame,instance->_frame_kind,tray.eval(record.t));
+        intersection.norm = transform_normal(instance->frame,instance->_frame_kind,normalize(mesh->norm[triangle.x]*u+
+                                                                                             mesh->norm[triangle.y]*v+
+                                                                                             mesh->norm[triangle.z]*(1-u-v)));
+        if(mesh->texcoord.empty()) intersection.texcoord = zero2f;
+        else {
+            intersection.texcoord = mesh->texcoord[triangle.x]*u+
+                                    mesh->texcoord[triangle.y]*v+
+                                    mesh->texcoord[triangle.z]*(1-u-v);
+            // ratio of the triangle areas in texture and in object space
+            auto uv1 = mesh->texcoord[triangle.y]-mesh->texcoord[triangle.x];
+            auto uv2 = mesh->texcoord[triangle.z]-mesh->texcoord[triangle.x];
+            auto area = length(cross(mesh->pos[triangle.y]-mesh->pos[triangle.x], mesh->pos[triangle.z]-mesh->pos[triangle.x]));
+            if(area > 0) intersection.texcoord_scale = sqrt(fabs(uv1.x*uv2.y-uv1.y*uv2.x) / area);
         }
-        // if did not hit the mesh, skip
-        if(not sintersection.hit) continue;
-        // check not first intersection, skip
-        if(sintersection.ray_t > intersection.ray_t and intersection.hit) continue;
-        // set interserction
-        intersection = sintersection;
-        // transform by mesh frame
-        intersection.pos = transform_point(mesh->frame,sintersection.pos);
-        intersection.norm = transform_normal(mesh->frame,sintersection.norm);
-        // set material
-        intersection.mat = sintersection.mat;
+        intersection.mat = instance->mat;
+        intersection.emitter = instance->_emitter;
+        intersection.triangle = record.prim;
     }
-    
-    // record closest intersection
     return intersection;
 }
 
+// intersects the scene and return the first intrerseciton
+intersection3f intersect(Scene* scene, ray3f ray) {
+    // create a default hit record
+    auto record = HitRecord();
+    // if accelerated, visit only the objects whose bounds the ray enters
+    if(scene->bvh) {
+        intersect(scene->bvh, ray, [scene,&record](int oid, const ray3f& sray, float& t){
+            if(not intersect_object(scene, oid, sray, record)) return false;
+            t = record.t;
+            return true;
+        });
+    } else {
+        // foreach surface
+        for(auto sid : range(scene->surfaces.size())) intersect_surface(scene, sid, ray, record);
+        // foreach mesh
+        for(auto mid : range(scene->meshes.size())) intersect_mesh(scene, mid, ray, record);
+    }
+    // set up the closest intersection
+    return make_intersection(scene, ray, record);
+}
+
+// intersects a surface and return for any intersection
+bool intersect_shadow(Surface* surface, const ray3f& ray) {
+    // compute ray intersection (and ray parameter), continue if not hit
+    auto tray = transform_ray_inverse(surface->frame,surface->_frame_kind,ray);
+    // if it is a quad, intersect quad
+    if(surface->isquad) return intersect_quad(tray, surface->radius);
+    // else intersect sphere
+    else return intersect_sphere(tray, surface->radius);
+}
+
+// intersects a mesh and return for any intersection
+bool intersect_shadow(Mesh* instance, const ray3f& ray) {
+    // grab the shared geometry
+    auto mesh = mesh_shape(instance);
+    // quads are not supported: check for error
+    error_if_not(mesh->quad.empty(), "quad intersection is not supported");
+    // tranform the ray
+    auto tray = transform_ray_inverse(instance->frame, instance->_frame_kind, ray);
+    // if it is accelerated by a wide bvh
+    if(mesh->bvh and not mesh->bvh->wide_nodes.empty()) {
+        auto tid = 0; auto t = 0.0f, u = 0.0f, v = 0.0f;
+        if(intersect_wide<true>(mesh, tray, tid, t, u, v)) return true;
+    }
+    // if it is accelerated
+    else if(mesh->bvh) {
+        if(intersect_shadow(mesh->bvh, tray,
+                            [mesh](int tid, ray3f tray){
+                                // grab triangle
+                                auto triangle = mesh->triangle[tid];
+                                      
+                                // grab vertices
+                                auto v0 = mesh->pos[triangle.x];
+                                auto v1 = mesh->pos[triangle.y];
+                                auto v2 = mesh->pos[triangle.z];
+                        
+                                // return if intersected
+                                return intersect_triangle(tray, v0, v1, v2);})) return true;
+    } else {
+        // foreach triangle
+        for(auto triangle : mesh->triangle) {
+            // grab vertices
+            auto v0 = mesh->pos[triangle.x];
+            auto v1 = mesh->pos[triangle.y];
+            auto v2 = mesh->pos[triangle.z];
+            
+            // intersect triangle
+            if(intersect_triangle(tray, v0, v1, v2)) return true;
+        }
+    }
+    // no intersection found
+    return false;
+}
+
 // intersects the scene and return for any intersection
 bool intersect_shadow(Scene* scene, ray3f ray) {
+    // if accelerated, visit only the objects whose bounds the ray enters
+    if(scene->bvh) {
+        auto nsurfaces = (int)scene->surfaces.size();
+        return intersect_shadow(scene->bvh, ray, [scene,nsurfaces](int oid, const ray3f& ray){
+            if(oid < nsurfaces) return intersect_shadow(scene->surfaces[oid], ray);
+            else return intersect_shadow(scene->meshes[oid - nsurfaces], ray); });
+    }
     // foreach surface
-    for(auto surface : scene->surfaces) {
-        // if it is a quad
-        if(surface->isquad) {
-            // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
-            
-            // intersect quad
-            if(intersect_quad(tray, surface->radius)) return true;
+    for(auto surface : scene->surfaces) if(intersect_shadow(surface, ray)) return true;
+    // foreach mesh
+    for(auto mesh : scene->meshes) if(intersect_shadow(mesh, ray)) return true;
+    // no intersection found
+    return false;
+}
+
+// packet of rays, stored as structure of arrays, with the interval bounds
+// of the packet used to cull bvh nodes missed by all rays at once
+struct ray3f_packet {
+    float4  e[3];       // origins
+    float4  d[3];       // directions
+    float4  id[3];      // inverse directions
+    float4  tmin;       // min t values
+    float4  tmax;       // max t values, shortened while hits are found
+    int     mask;       // active rays
+    
+    vec3f   e_min, e_max;   // origin bounds
+    vec3f   id_min, id_max; // inverse direction bounds
+    float   t_min;          // min t value over all rays
+    
+    // build a packet from up to four rays (inactive lanes repeat the first ray)
+    ray3f_packet(const ray3f* rays, int nrays) : mask((1 << nrays) - 1) {
+        float ee[3][4], dd[3][4], tn[4], tx[4];
+        for(auto k : range(4)) {
+            auto& ray = rays[(k < nrays) ? k : 0];
+            for(auto a : range(3)) { ee[a][k] = ray.e[a]; dd[a][k] = ray.d[a]; }
+            tn[k] = ray.tmin; tx[k] = ray.tmax;
+        }
+        for(auto a : range(3)) {
+            e[a] = float4(ee[a][0],ee[a][1],ee[a][2],ee[a][3]);
+            d[a] = float4(dd[a][0],dd[a][1],dd[a][2],dd[a][3]);
+            id[a] = float4(1) / d[a];
+        }
+        tmin = float4(tn[0],tn[1],tn[2],tn[3]);
+        tmax = float4(tx[0],tx[1],tx[2],tx[3]);
+        e_min = e_max = rays[0].e;
+        id_min = id_max = vec3f(1/rays[0].d.x, 1/rays[0].d.y, 1/rays[0].d.z);
+        t_min = rays[0].tmin;
+        for(auto k : range(1,nrays)) {
+            auto id = vec3f(1/rays[k].d.x, 1/rays[k].d.y, 1/rays[k].d.z);
+            e_min = min(e_min,rays[k].e); e_max = max(e_max,rays[k].e);
+            id_min = min(id_min,id); id_max = max(id_max,id);
+            t_min = min(t_min,rays[k].tmin);
+        }
+    }
+};
+
+// comparison mask with the lanes set in a bitmask
+inline float4 lanes(int mask) {
+    return float4((mask & 1) ? 1.0f : 0.0f, (mask & 2) ? 1.0f : 0.0f, (mask & 4) ? 1.0f : 0.0f, (mask & 8) ? 1.0f : 0.0f) != float4(0.0f);
+}
+
+// check whether rays are coherent enough to be traced as a packet, i.e. whether
+// their directions have the same signs so that the packet bounds can cull nodes
+inline bool is_coherent(const ray3f* rays, int nrays) {
+    if(nrays < 2) return false;
+    for(auto k : range(1,nrays)) {
+        for(auto a : range(3)) {
+            if((rays[k].d[a] < 0) != (rays[0].d[a] < 0) or rays[k].d[a] == 0) return false;
+        }
+    }
+    return true;
+}
+
+// transform a packet of rays by a frame inverse
+inline void transform_rays_inverse(const frame3f& f, int kind, const ray3f* rays, int nrays, ray3f* trays) {
+    for(auto k : range(nrays)) trays[k] = transform_ray_inverse(f, kind, rays[k]);
+}
+
+// check whether all rays of a packet miss a bounding box, by interval arithmetic
+// over the packet bounds (axes where the direction signs disagree, or directions
+// are parallel to the slabs, are not used to cull)
+inline bool intersect_bbox_packet_cull(const ray3f_packet& packet, float tmax, const range3f& bbox) {
+    auto t0 = packet.t_min, t1 = tmax;
+    for(auto a : range(3)) {
+        // skip axes without a common, finite direction sign
+        if(not (packet.id_min[a] > 0 or packet.id_max[a] < 0)) continue;
+        if(not (std::isfinite(packet.id_min[a]) and std::isfinite(packet.id_max[a]))) continue;
+        // near and far planes depend on the common direction sign
+        auto bnear = (packet.id_min[a] >= 0) ? bbox.min[a] : bbox.max[a];
+        auto bfar  = (packet.id_min[a] >= 0) ? bbox.max[a] : bbox.min[a];
+        // lower bound of near t and upper bound of far t over all rays
+        auto n0 = (bnear - packet.e_max[a]), n1 = (bnear - packet.e_min[a]);
+        auto f0 = (bfar - packet.e_max[a]), f1 = (bfar - packet.e_min[a]);
+        auto tnear = min(min(n0*packet.id_min[a], n0*packet.id_max[a]), min(n1*packet.id_min[a], n1*packet.id_max[a]));
+        auto tfar = max(max(f0*packet.id_min[a], f0*packet.id_max[a]), max(f1*packet.id_min[a], f1*packet.id_max[a]));
+        t0 = max(t0, tnear); t1 = min(t1, tfar);
+        if(t0 > t1) return true;
+    }
+    return false;
+}
+
+// intersect a bounding box with all rays of a packet, returning the mask of rays that hit
+inline int intersect_bbox_packet(const ray3f_packet& packet, const range3f& bbox) {
+    auto t0 = packet.tmin, t1 = packet.tmax;
+    for(auto a : range(3)) {
+        auto tnear = (float4(bbox.min[a]) - packet.e[a]) * packet.id[a];
+        auto tfar = (float4(bbox.max[a]) - packet.e[a]) * packet.id[a];
+        t0 = max(t0, min(tnear, tfar));
+        t1 = min(t1, max(tnear, tfar));
+    }
+    return (t0 <= t1).mask() & packet.mask;
+}
+
+// intersect a triangle with all rays of a packet, returning the mask of rays that hit
+// and setting their ray parameter and barycentric coordinates (same test as intersect_triangle)
+inline int intersect_triangle_packet(const ray3f_packet& packet, const vec3f& v0, const vec3f& v1, const vec3f& v2,
+                                     float4& t, float4& ba, float4& bb) {
+    auto a = v0 - v2;
+    auto b = v1 - v2;
+    float4 e[3] = { packet.e[0] - float4(v2.x), packet.e[1] - float4(v2.y), packet.e[2] - float4(v2.z) };
+    auto& i = packet.d;
+    
+    // cross(i,b) and cross(a,i), with a and b shared by all rays
+    float4 ib[3] = { i[1]*float4(b.z) - i[2]*float4(b.y), i[2]*float4(b.x) - i[0]*float4(b.z), i[0]*float4(b.y) - i[1]*float4(b.x) };
+    float4 ai[3] = { float4(a.y)*i[2] - float4(a.z)*i[1], float4(a.z)*i[0] - float4(a.x)*i[2], float4(a.x)*i[1] - float4(a.y)*i[0] };
+    
+    auto d = ib[0]*float4(a.x) + ib[1]*float4(a.y) + ib[2]*float4(a.z);
+    auto id = float4(1) / d;
+    // dot(cross(e,a),b) = dot(e,cross(a,b))
+    auto ab = cross(a,b);
+    t = (e[0]*float4(ab.x) + e[1]*float4(ab.y) + e[2]*float4(ab.z)) * id;
+    ba = (ib[0]*e[0] + ib[1]*e[1] + ib[2]*e[2]) * id;
+    bb = (ai[0]*e[0] + ai[1]*e[1] + ai[2]*e[2]) * id;
+    
+    auto hit = (d != float4(0.0f)) & (t >= packet.tmin) & (t <= packet.tmax) &
+               (ba >= float4(0.0f)) & (bb >= float4(0.0f)) & (ba + bb <= float4(1));
+    return hit.mask() & packet.mask;
+}
+
+// intersect a mesh bvh with a packet of rays, updating the records of the rays that
+// find a closer hit (the packet rays are shortened to the closest hits so far)
+void intersect_packet(Scene* scene, int mid, ray3f_packet& packet, HitRecord* records) {
+    auto mesh = mesh_shape(scene->meshes[mid]);
+    auto bvh = mesh->bvh;
+    // nodes left to visit
+    int stack[BVHAccelerator_stack_size];
+    auto stack_size = 0;
+    stack[stack_size++] = 0;
+    while(stack_size) {
+        auto nodeid = stack[--stack_size];
+        auto& node = bvh->nodes[nodeid];
+        // cull nodes missed by the whole packet, then test each ray
+        float tmax[4]; packet.tmax.store(tmax);
+        if(intersect_bbox_packet_cull(packet, max(max(tmax[0],tmax[1]),max(tmax[2],tmax[3])), node.bbox)) continue;
+        if(not intersect_bbox_packet(packet, node.bbox)) continue;
+        if(not node.leaf()) {
+            // push the far child first, with the direction signs shared by the packet
+            if(packet.id_min[node.axis] < 0) { stack[stack_size++] = nodeid+1; stack[stack_size++] = node.start; }
+            else { stack[stack_size++] = node.start; stack[stack_size++] = nodeid+1; }
+            continue;
+        }
+        for(int idx = node.start; idx < node.start + node.count; idx ++) {
+            auto tid = mesh->bvh->prims[idx];
+            auto triangle = mesh->triangle[tid];
+            auto t = float4(), u = float4(), v = float4();
+            auto hit = intersect_triangle_packet(packet, mesh->pos[triangle.x], mesh->pos[triangle.y], mesh->pos[triangle.z], t, u, v);
+            if(not hit) continue;
+            // shorten the rays that hit
+            packet.tmax = select(lanes(hit), t, packet.tmax);
+            float tt[4], ut[4], vt[4]; t.store(tt); u.store(ut); v.store(vt);
+            for(auto k : range(4)) {
+                if(not (hit & (1 << k))) continue;
+                records[k].t = tt[k]; records[k].u = ut[k]; records[k].v = vt[k];
+                records[k].prim = tid; records[k].mesh = mid;
+            }
+        }
+    }
+}
+
+// intersect a mesh bvh with a packet of shadow rays, removing occluded rays from the packet
+void intersect_shadow_packet(Mesh* mesh, ray3f_packet& packet) {
+    auto bvh = mesh->bvh;
+    // nodes left to visit
+    int stack[BVHAccelerator_stack_size];
+    auto stack_size = 0;
+    stack[stack_size++] = 0;
+    while(stack_size and packet.mask) {
+        auto nodeid = stack[--stack_size];
+        auto& node = bvh->nodes[nodeid];
+        // cull nodes missed by the whole packet, then test each ray
+        float tmax[4]; packet.tmax.store(tmax);
+        if(intersect_bbox_packet_cull(packet, max(max(tmax[0],tmax[1]),max(tmax[2],tmax[3])), node.bbox)) continue;
+        if(not intersect_bbox_packet(packet, node.bbox)) continue;
+        if(not node.leaf()) {
+            // push the far child first, with the direction signs shared by the packet
+            if(packet.id_min[node.axis] < 0) { stack[stack_size++] = nodeid+1; stack[stack_size++] = node.start; }
+            else { stack[stack_size++] = node.start; stack[stack_size++] = nodeid+1; }
+            continue;
+        }
+        for(int idx = node.start; idx < node.start + node.count and packet.mask; idx ++) {
+            auto triangle = mesh->triangle[bvh->prims[idx]];
+            auto t = float4(), u = float4(), v = float4();
+            packet.mask &= ~intersect_triangle_packet(packet, mesh->pos[triangle.x], mesh->pos[triangle.y], mesh->pos[triangle.z], t, u, v);
+        }
+    }
+}
+
+// intersect an object of the scene with the rays of a packet in mask, updating the
+// records of the rays that find a closer hit
+void intersect_object_packet(Scene* scene, int oid, const ray3f* rays, int nrays, int mask, HitRecord* records) {
+    auto nsurfaces = (int)scene->surfaces.size();
+    // intersect surfaces and unaccelerated meshes one ray at a time
+    if(oid < nsurfaces or not mesh_shape(scene->meshes[oid - nsurfaces])->bvh) {
+        for(auto k : range(nrays)) if(mask & (1 << k)) intersect_object(scene, oid, rays[k], records[k]);
+        return;
+    }
+    // tranform the rays, shortened to the closest hit found so far
+    auto mid = oid - nsurfaces;
+    ray3f trays[ray3f_packet_size];
+    transform_rays_inverse(scene->meshes[mid]->frame, scene->meshes[mid]->_frame_kind, rays, nrays, trays);
+    // fall back to single rays if the frame breaks the packet coherence
+    if(not is_coherent(trays, nrays)) {
+        for(auto k : range(nrays)) if(mask & (1 << k)) intersect_object(scene, oid, rays[k], records[k]);
+        return;
+    }
+    for(auto k : range(nrays)) if(records[k].hit()) trays[k].tmax = records[k].t;
+    // trace the packet
+    auto packet = ray3f_packet(trays, nrays);
+    packet.mask = mask;
+    intersect_packet(scene, mid, packet, records);
+}
+
+// intersect an object of the scene with the shadow rays of a packet in mask,
+// returning the mask of rays occluded
+int intersect_shadow_object_packet(Scene* scene, int oid, const ray3f* rays, int nrays, int mask) {
+    auto nsurfaces = (int)scene->surfaces.size();
+    auto occluded = 0;
+    // intersect surfaces and unaccelerated meshes one ray at a time
+    if(oid < nsurfaces) {
+        for(auto k : range(nrays)) if((mask & (1 << k)) and intersect_shadow(scene->surfaces[oid], rays[k])) occluded |= 1 << k;
+        return occluded;
+    }
+    auto instance = scene->meshes[oid - nsurfaces];
+    if(not mesh_shape(instance)->bvh) {
+        for(auto k : range(nrays)) if((mask & (1 << k)) and intersect_shadow(instance, rays[k])) occluded |= 1 << k;
+        return occluded;
+    }
+    // trace the packet, or single rays if the frame breaks the packet coherence
+    ray3f trays[ray3f_packet_size];
+    transform_rays_inverse(instance->frame, instance->_frame_kind, rays, nrays, trays);
+    if(not is_coherent(trays, nrays)) {
+        for(auto k : range(nrays)) if((mask & (1 << k)) and intersect_shadow(instance, rays[k])) occluded |= 1 << k;
+        return occluded;
+    }
+    auto packet = ray3f_packet(trays, nrays);
+    packet.mask = mask;
+    intersect_shadow_packet(mesh_shape(instance), packet);
+    return mask & ~packet.mask;
+}
+
+// visit the objects of the scene bvh whose bounds are entered by the rays of a packet,
+// nearest first, calling visit_object with the object and the mask of rays entering its
+// leaf; visit_object may shorten the packet rays or remove them from the packet
+template<typename visit_func>
+void intersect_objects_packet(BVHAccelerator* bvh, ray3f_packet& packet, const visit_func& visit_object) {
+    // nodes left to visit
+    int stack[BVHAccelerator_stack_size];
+    auto stack_size = 0;
+    stack[stack_size++] = 0;
+    while(stack_size and packet.mask) {
+        auto nodeid = stack[--stack_size];
+        auto& node = bvh->nodes[nodeid];
+        // cull nodes missed by the whole packet, then test each ray
+        float tmax[4]; packet.tmax.store(tmax);
+        if(intersect_bbox_packet_cull(packet, max(max(tmax[0],tmax[1]),max(tmax[2],tmax[3])), node.bbox)) continue;
+        auto mask = intersect_bbox_packet(packet, node.bbox);
+        if(not mask) continue;
+        if(not node.leaf()) {
+            // push the far child first, with the direction signs shared by the packet
+            if(packet.id_min[node.axis] < 0) { stack[stack_size++] = nodeid+1; stack[stack_size++] = node.start; }
+            else { stack[stack_size++] = node.start; stack[stack_size++] = nodeid+1; }
+            continue;
+        }
+        for(int idx = node.start; idx < node.start + node.count and (mask & packet.mask); idx ++) {
+            visit_object(bvh->prims[idx], mask & packet.mask);
+        }
+    }
+}
+
+// intersects the scene with a batch of rays, tracing coherent groups of
+// ray3f_packet_size rays as packets, and returns the first intersections
+void intersect(Scene* scene, const ray3f* rays, int nrays, intersection3f* intersections) {
+    auto nobjects = (int)(scene->surfaces.size() + scene->meshes.size());
+    for(auto start = 0; start < nrays; start += ray3f_packet_size) {
+        auto prays = rays + start;
+        auto pintersections = intersections + start;
+        auto n = min(ray3f_packet_size, nrays - start);
+        // fall back to single rays if not coherent
+        if(not is_coherent(prays, n)) {
+            for(auto k : range(n)) pintersections[k] = intersect(scene, prays[k]);
+            continue;
+        }
+        HitRecord records[ray3f_packet_size];
+        // if accelerated, visit only the objects entered by the packet, shortening
+        // the packet rays to the closest hits found so far
+        if(scene->bvh) {
+            auto packet = ray3f_packet(prays, n);
+            intersect_objects_packet(scene->bvh, packet, [&](int oid, int mask){
+                intersect_object_packet(scene, oid, prays, n, mask, records);
+                float tmax[4]; packet.tmax.store(tmax);
+                for(auto k : range(n)) if(records[k].hit()) tmax[k] = records[k].t;
+                packet.tmax = float4(tmax);
+            });
         } else {
-            // compute ray intersection (and ray parameter), continue if not hit
-            auto tray = transform_ray_inverse(surface->frame,ray);
-            
-            // intersect sphere
-            if(intersect_sphere(tray, surface->radius)) return true;
+            // foreach object, surfaces followed by meshes
+            for(auto oid : range(nobjects)) intersect_object_packet(scene, oid, prays, n, (1 << n) - 1, records);
         }
+        // set up the closest intersections
+        for(auto k : range(n)) pintersections[k] = make_intersection(scene, prays[k], records[k]);
     }
-    // foreach mesh
-    for(auto mesh : scene->meshes) {
-        // quads are not supported: check for error
-        error_if_not(mesh->quad.empty(), "quad intersection is not supported");
-        // tranform the ray
-        auto tray = transform_ray_inverse(mesh->frame, ray);
-        // if it is accelerated
-        if(mesh->bvh) {
-            if(intersect_shadow(mesh->bvh, 0, tray,
-                                [mesh](int tid, ray3f tray){
-                                    // grab triangle
-                                    auto triangle = mesh->triangle[tid];
-                                          
-                                    // grab vertices
-                                    auto v0 = mesh->pos[triangle.x];
-                                    auto v1 = mesh->pos[triangle.y];
-                                    auto v2 = mesh->pos[triangle.z];
-                            
-                                    // return if intersected
-                                    return intersect_triangle(tray, v0, v1, v2);})) return true;
+}
+
+// intersects the scene with a batch of shadow rays, tracing coherent groups of
+// ray3f_packet_size rays as packets, and returns whether each ray is occluded
+void intersect_shadow(Scene* scene, const ray3f* rays, int nrays, bool* occluded) {
+    auto nobjects = (int)(scene->surfaces.size() + scene->meshes.size());
+    for(auto start = 0; start < nrays; start += ray3f_packet_size) {
+        auto prays = rays + start;
+        auto poccluded = occluded + start;
+        auto n = min(ray3f_packet_size, nrays - start);
+        // fall back to single rays if not coherent
+        if(not is_coherent(prays, n)) {
+            for(auto k : range(n)) poccluded[k] = intersect_shadow(scene, prays[k]);
+            continue;
+        }
+        // rays not occluded yet
+        auto mask = (1 << n) - 1;
+        // if accelerated, visit only the objects entered by the packet, removing
+        // occluded rays from it
+        if(scene->bvh) {
+            auto packet = ray3f_packet(prays, n);
+            intersect_objects_packet(scene->bvh, packet, [&](int oid, int mask){
+                packet.mask &= ~intersect_shadow_object_packet(scene, oid, prays, n, mask);
+            });
+            mask = packet.mask;
+        } else {
+            // foreach object, trace the rays not occluded yet
+            for(auto oid = 0; oid < nobjects and mask; oid ++) mask &= ~intersect_shadow_object_packet(scene, oid, prays, n, mask);
+        }
+        for(auto k : range(n)) poccluded[k] = not (mask & (1 << k));
+    }
+}
+
+#define BVHAccelerator_cache_version 2
+
+// hash bytes, by fnv-1a
+inline unsigned long long hash_bytes(unsigned long long hash, const void* data, size_t size) {
+    auto bytes = (const unsigned char*)data;
+    for(auto i : range(size)) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+// key of a mesh accelerator in the cache, hashing the triangles, their vertices and
+// the build parameters, so that any change in them misses the cache
+unsigned long long make_accelerator_cache_key(Mesh* mesh) {
+    auto hash = 14695981039346656037ull;
+    hash = hash_bytes(hash, mesh->pos.data(), mesh->pos.size()*sizeof(vec3f));
+    hash = hash_bytes(hash, mesh->triangle.data(), mesh->triangle.size()*sizeof(vec3i));
+    float params[] = { BVHAccelerator_cache_version, BVHAccelerator_min_prims, BVHAccelerator_epsilon,
+        BVHAccelerator_build_maxaxis, BVHAccelerator_build_sah, BVHAccelerator_sah_bins,
+        BVHAccelerator_sah_traversal_cost, BVHAccelerator_sah_leaf_cost, BVHAccelerator_sah_max_prims,
+        BVHAccelerator_sah_max_depth, BVHAccelerator_wide,
+        sizeof(BVHNode), sizeof(BVHWideNode), sizeof(BVHTriangles4) };
+    return hash_bytes(hash, params, sizeof(params));
+}
+
+// cache file header
+struct BVHCacheHeader {
+    unsigned long long key = 0;         // cache key
+    unsigned long long ntriangles = 0;  // mesh triangles
+    unsigned long long nprims = 0;      // accelerator prims
+    unsigned long long nnodes = 0;      // binary nodes
+    unsigned long long nwide_nodes = 0; // wide nodes
+    unsigned long long npacked = 0;     // packed triangle groups
+};
+
+// cache file of a mesh accelerator
+string accelerator_cache_filename(const string& dirname, unsigned long long key) {
+    char name[32]; sprintf(name, "%016llx.bvh", key);
+    return dirname + "/" + name;
+}
+
+// save a mesh accelerator to the cache directory, writing a temporary file
+// that is then renamed, so that readers never see partial files
+void save_accelerator_cache(Mesh* mesh, const string& dirname, unsigned long long key, int sid) {
+    auto bvh = mesh->bvh;
+    auto filename = accelerator_cache_filename(dirname, key);
+    auto tmpname = filename + "." + std::to_string(sid) + ".tmp";
+    auto f = fopen(tmpname.c_str(), "wb");
+    if(not f) { message("cannot write bvh cache %s\n", tmpname.c_str()); return; }
+    auto header = BVHCacheHeader();
+    header.key = key; header.ntriangles = mesh->triangle.size();
+    header.nprims = bvh->prims.size(); header.nnodes = bvh->nodes.size();
+    header.nwide_nodes = bvh->wide_nodes.size(); header.npacked = bvh->triangles.size();
+    auto ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok and fwrite(bvh->prims.data(), sizeof(int), header.nprims, f) == header.nprims;
+    ok = ok and fwrite(bvh->nodes.data(), sizeof(BVHNode), header.nnodes, f) == header.nnodes;
+    ok = ok and fwrite(bvh->wide_nodes.data(), sizeof(BVHWideNode), header.nwide_nodes, f) == header.nwide_nodes;
+    ok = ok and fwrite(bvh->triangles.data(), sizeof(BVHTriangles4), header.npacked, f) == header.npacked;
+    ok = (fclose(f) == 0) and ok;
+    if(ok) { remove(filename.c_str()); ok = rename(tmpname.c_str(), filename.c_str()) == 0; }
+    if(not ok) { message("cannot write bvh cache %s\n", filename.c_str()); remove(tmpname.c_str()); }
+}
+
+// check that a loaded accelerator over ntriangles can be traversed safely: all indices
+// in range, children stored after their parents, so that there are no cycles, and trees
+// shallow enough for the traversal stacks
+bool check_accelerator(BVHAccelerator* bvh, int ntriangles) {
+    auto nprims = (int)bvh->prims.size(), nnodes = (int)bvh->nodes.size();
+    auto nwide_nodes = (int)bvh->wide_nodes.size(), npacked = (int)bvh->triangles.size();
+    for(auto prim : bvh->prims) if(prim < 0 or prim >= ntriangles) return false;
+    // binary nodes, with depths propagated forward since children follow their parents
+    auto depth = vector<int>(nnodes, 0);
+    for(auto nodeid : range(nnodes)) {
+        auto& node = bvh->nodes[nodeid];
+        if(depth[nodeid] >= BVHAccelerator_stack_size) return false;
+        if(node.leaf()) {
+            if(node.start < 0 or node.start > nprims - node.count) return false;
         } else {
-            // foreach triangle
-            for(auto triangle : mesh->triangle) {
-                // grab vertices
-                auto v0 = mesh->pos[triangle.x];
-                auto v1 = mesh->pos[triangle.y];
-                auto v2 = mesh->pos[triangle.z];
-                
-                // intersect triangle
-                if(intersect_triangle(tray, v0, v1, v2)) return true;
+            if(node.count != 0 or node.axis < 0 or node.axis > 2) return false;
+            if(nodeid+1 >= nnodes or node.start <= nodeid+1 or node.start >= nnodes) return false;
+            depth[nodeid+1] = max(depth[nodeid+1], depth[nodeid]+1);
+            depth[node.start] = max(depth[node.start], depth[nodeid]+1);
+        }
+    }
+    // wide nodes, whose traversal pushes up to three more entries each level
+    depth.assign(nwide_nodes, 0);
+    for(auto wideid : range(nwide_nodes)) {
+        auto& node = bvh->wide_nodes[wideid];
+        if(3*depth[wideid]+4 > BVHAccelerator_wide_stack_size) return false;
+        for(auto c : range(4)) {
+            if(node.count[c] > 0) {
+                if(node.child[c] < 0 or node.child[c] > npacked - (node.count[c]+3)/4) return false;
+            } else if(node.count[c] == 0 and node.child[c] == 0) {
+                // empty slots must hold the far away box
+                for(auto a : range(3)) if(node.bbox_min[a][c] != 1e30f or node.bbox_max[a][c] != 1e30f) return false;
+            } else {
+                if(node.count[c] != 0 or node.child[c] <= wideid or node.child[c] >= nwide_nodes) return false;
+                depth[node.child[c]] = max(depth[node.child[c]], depth[wideid]+1);
             }
         }
     }
-    
-    // no intersection found
-    return false;
+    for(auto& triangles : bvh->triangles) {
+        for(auto k : range(4)) if(triangles.prim[k] < 0 or triangles.prim[k] >= ntriangles) return false;
+    }
+    return true;
+}
+
+// load a mesh accelerator from the cache directory, reading each array at once;
+// returns nullptr if not cached or the file does not match the mesh, so that it is rebuilt
+BVHAccelerator* load_accelerator_cache(Mesh* mesh, const string& dirname, unsigned long long key) {
+    auto filename = accelerator_cache_filename(dirname, key);
+    auto f = fopen(filename.c_str(), "rb");
+    if(not f) return nullptr;
+    // bound the counts by the triangles, before allocating: a binary tree has fewer than
+    // twice as many nodes as primitives, and each leaf packs at most as many groups as triangles
+    auto ntriangles = (unsigned long long)mesh->triangle.size();
+    auto header = BVHCacheHeader();
+    auto ok = fread(&header, sizeof(header), 1, f) == 1 and header.key == key and
+              header.ntriangles == ntriangles and header.nprims == ntriangles and
+              header.nnodes > 0 and header.nnodes < 2*ntriangles and
+              header.nwide_nodes <= header.nnodes and header.npacked <= ntriangles;
+    auto bvh = new BVHAccelerator();
+    if(ok) {
+        bvh->prims.resize(header.nprims); bvh->nodes.resize(header.nnodes);
+        bvh->wide_nodes.resize(header.nwide_nodes); bvh->triangles.resize(header.npacked);
+        ok = fread(bvh->prims.data(), sizeof(int), header.nprims, f) == header.nprims;
+        ok = ok and fread(bvh->nodes.data(), sizeof(BVHNode), header.nnodes, f) == header.nnodes;
+        ok = ok and fread(bvh->wide_nodes.data(), sizeof(BVHWideNode), header.nwide_nodes, f) == header.nwide_nodes;
+        ok = ok and fread(bvh->triangles.data(), sizeof(BVHTriangles4), header.npacked, f) == header.npacked;
+        ok = ok and check_accelerator(bvh, (int)ntriangles);
+    }
+    fclose(f);
+    if(not ok) { message("invalid bvh cache %s\n", filename.c_str()); delete bvh; return nullptr; }
+    bvh->cost = accelerator_cost(bvh);
+    return bvh;
+}
+
+// build the scene top-level accelerator over the world bounds of the objects,
+// i.e. the surfaces followed by the meshes, whose own accelerators are the bottom level,
+// and cache the kind of the object frames
+void make_scene_accelerator(Scene* scene) {
+    for(auto surface : scene->surfaces) surface->_frame_kind = frame_kind(surface->frame);
+    for(auto mesh : scene->meshes) mesh->_frame_kind = frame_kind(mesh->frame);
+    scene->bvh = nullptr;
+    // check whether to accelerate
+    auto nobjects = scene->surfaces.size() + scene->meshes.size();
+    if(nobjects <= BVHAccelerator_min_prims) return;
+    auto start = std::chrono::steady_clock::now();
+    // grab all local bbox
+    auto bboxes = vector<range3f>();
+    auto frames = vector<frame3f>();
+    for(auto surface : scene->surfaces) {
+        auto r = surface->radius;
+        bboxes.push_back(range3f(vec3f(-r,-r,(surface->isquad)?0:-r),vec3f(r,r,(surface->isquad)?0:r)));
+        frames.push_back(surface->frame);
+    }
+    auto shape_bboxes = map<Mesh*,range3f>();
+    for(auto mesh : scene->meshes) {
+        // compute the bbox once for each shared geometry
+        auto shape = mesh_shape(mesh);
+        if(shape_bboxes.find(shape) == shape_bboxes.end()) {
+            auto bbox = range3f();
+            for(auto p : shape->pos) bbox = runion(bbox,p);
+            shape_bboxes[shape] = bbox;
+        }
+        bboxes.push_back(shape_bboxes[shape]);
+        frames.push_back(mesh->frame);
+    }
+    // transform them to world space
+    for(auto i : range(nobjects)) {
+        auto bbox = range3f();
+        for(auto p : corners(bboxes[i])) bbox = runion(bbox,transform_point(frames[i],p));
+        bboxes[i] = bbox;
+    }
+    // make binary accelerator, since leaves hold objects
+    scene->bvh = make_accelerator(bboxes, 1, false);
+    message("accelerating scene: %d objects, %d nodes in %.3fs\n", (int)nobjects, (int)scene->bvh->nodes.size(),
+            std::chrono::duration<float>(std::chrono::steady_clock::now()-start).count());
 }
 
-// prepare scene acceleration and triangulate meshes
+// prepare scene acceleration and triangulate meshes, building the
+// acceleration structure of each shared geometry once for all its instances
 void accelerate(Scene* scene) {
+    // grab the shared geometries, with their number of instances
+    auto shapes = vector<Mesh*>();
+    auto instances = map<Mesh*,int>();
+    for(auto mesh : scene->meshes) {
+        auto shape = mesh_shape(mesh);
+        if(not instances[shape]++) shapes.push_back(shape);
+    }
     // triangulate
-    for (auto mesh : scene->meshes) {
+    for (auto mesh : shapes) {
         for(auto f : mesh->quad) {
             mesh->triangle.push_back({f.x,f.y,f.z});
             mesh->triangle.push_back({f.x,f.z,f.w});
         }
         mesh->quad.clear();
     }
-    // make acceleration structure
-    for(auto mesh : scene->meshes) {
+    // make top-level acceleration structure
+    make_scene_accelerator(scene);
+    // meshes to accelerate, largest first, with their share of the build tasks
+    auto nthreads = (BVHAccelerator_build_parallel) ? max(1, (int)std::thread::hardware_concurrency()) : 1;
+    auto meshes = vector<int>();
+    auto total = 0l;
+    for(auto sid : range(shapes.size())) {
+        auto mesh = shapes[sid];
+        mesh->bvh = nullptr;
         // check whether to accelerate
-        if (mesh->triangle.size()+mesh->quad.size() > BVHAccelerator_min_prims) {
-            // grab all bbox
-            auto bboxes = vector<range3f>(mesh->triangle.size());
-            for(auto i : range(mesh->triangle.size())) {
-                auto f = mesh->triangle[i];
-                bboxes[i] = make_range3f({mesh->pos[f.x],mesh->pos[f.y],mesh->pos[f.z]});
+        if(mesh->triangle.size() <= BVHAccelerator_min_prims) continue;
+        meshes.push_back(sid);
+        total += mesh->triangle.size();
+    }
+    std::sort(meshes.begin(), meshes.end(), [&shapes](int a, int b){
+        return shapes[a]->triangle.size() > shapes[b]->triangle.size(); });
+    if(meshes.empty()) return;
+    
+    // make acceleration structures, building independent meshes concurrently,
+    // or loading them from the cache if enabled
+    auto times = vector<float>(shapes.size(), 0);
+    auto cached = vector<int>(shapes.size(), 0);
+    std::atomic<size_t> next(0);
+    auto start = std::chrono::steady_clock::now();
+    auto build = [&](){
+        for(auto idx = next++; idx < meshes.size(); idx = next++) {
+            auto mesh = shapes[meshes[idx]];
+            auto mesh_start = std::chrono::steady_clock::now();
+            // check the cache
+            auto key = 0ull;
+            if(not scene->bvh_cache.empty()) {
+                key = make_accelerator_cache_key(mesh);
+                mesh->bvh = load_accelerator_cache(mesh, scene->bvh_cache, key);
+                if(mesh->bvh) {
+                    cached[meshes[idx]] = 1;
+                    times[meshes[idx]] = std::chrono::duration<float>(std::chrono::steady_clock::now()-mesh_start).count();
+                    continue;
+                }
             }
             // make accelerator
-            mesh->bvh = make_accelerator(bboxes);
-        } else mesh->bvh = nullptr;
+            make_mesh_accelerator(mesh, max(1, (int)(nthreads * mesh->triangle.size() / total)));
+            // save it to the cache
+            if(not scene->bvh_cache.empty()) save_accelerator_cache(mesh, scene->bvh_cache, key, meshes[idx]);
+            times[meshes[idx]] = std::chrono::duration<float>(std::chrono::steady_clock::now()-mesh_start).count();
+        }
+    };
+    auto threads = vector<std::thread>();
+    while((int)threads.size() < min(nthreads, (int)meshes.size()) - 1) threads.push_back(std::thread(build));
+    build();
+    for(auto& thread : threads) thread.join();
+    
+    // report build times
+    for(auto sid : range(shapes.size())) {
+        if(not shapes[sid]->bvh) continue;
+        message("accelerating mesh %d: %d triangles, %d nodes, %d instances in %.3fs%s\n", sid, (int)shapes[sid]->triangle.size(),
+                (int)shapes[sid]->bvh->nodes.size(), instances[shapes[sid]], times[sid], (cached[sid]) ? " (cached)" : "");
+    }
+    message("accelerating done: %d meshes with %d threads in %.3fs\n", (int)meshes.size(), nthreads,
+            std::chrono::duration<float>(std::chrono::steady_clock::now()-start).count());
+}
+
+// refit the scene acceleration after the mesh vertices moved, keeping the topology of
+// the mesh bvhs and rebuilding the ones whose quality degraded too much
+void refit(Scene* scene) {
+    auto nthreads = (BVHAccelerator_build_parallel) ? max(1, (int)std::thread::hardware_concurrency()) : 1;
+    auto start = std::chrono::steady_clock::now();
+    auto shapes = set<Mesh*>();
+    auto refitted = 0, rebuilt = 0;
+    for(auto mesh : scene->meshes) {
+        auto shape = mesh_shape(mesh);
+        // refit each shared geometry once
+        if(not shapes.insert(shape).second) continue;
+        if(not shape->bvh) continue;
+        // rebuild if the triangles changed or the refitted bvh degraded
+        if(shape->bvh->prims.size() == shape->triangle.size() and refit_accelerator(shape, nthreads)) refitted ++;
+        else {
+            delete shape->bvh;
+            make_mesh_accelerator(shape, nthreads);
+            rebuilt ++;
+        }
     }
+    // the scene bvh is rebuilt since it is small
+    make_scene_accelerator(scene);
+    message("refitting done: %d meshes refitted, %d rebuilt in %.3fs\n", refitted, rebuilt,
+            std::chrono::duration<float>(std::chrono::steady_clock::now()-start).count());
 }
 
 // intersects the scene's surfaces and return the first intrerseciton (used for raytracing homework)
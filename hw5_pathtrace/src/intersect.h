@@ -10,13 +10,16 @@ struct intersection3f {
     vec3f       pos;        // hit position
     vec3f       norm;       // hit normal
     vec2f       texcoord;   // hit texture coordinates
+    float       texcoord_scale; // change of the texture coordinates per unit length on the surface
     Material*   mat;        // hit material
+    int         emitter;    // emitter index of the hit object (-1 if it is not a light)
+    int         triangle;   // triangle index of the hit mesh (-1 for surfaces)
     
     // constructor (defaults to no intersection)
-    intersection3f() : hit(false) { }
+    intersection3f() : hit(false), texcoord_scale(0), emitter(-1), triangle(-1) { }
     
     // constructor to override default intersection
-    explicit intersection3f(bool hit) : hit(hit) { }
+    explicit intersection3f(bool hit) : hit(hit), texcoord_scale(0), emitter(-1), triangle(-1) { }
 };
 
 #define ray3f_epsilon 0.0005f
@@ -55,12 +58,24 @@ inline ray3f transform_ray_inverse(const frame3f& f, const ray3f& v) { return ra
 // prepare scene acceleration and triangulate meshes
 void accelerate(Scene* scene);
 
+// refit the scene acceleration after the mesh vertices moved, rebuilding what degraded too much
+void refit(Scene* scene);
+
 // intersects the scene and return the first intrerseciton
 intersection3f intersect(Scene* scene, ray3f ray);
 
 // intersects the scene and return any intrerseciton
 bool intersect_shadow(Scene* scene, ray3f ray);
 
+#define ray3f_packet_size 4
+
+// intersects the scene with a batch of rays, tracing coherent groups of
+// ray3f_packet_size rays as packets, and returns the first intersections
+void intersect(Scene* scene, const ray3f* rays, int nrays, intersection3f* intersections);
+
+// intersects the scene with a batch of shadow rays, in packets as above, and returns whether each ray is occluded
+void intersect_shadow(Scene* scene, const ray3f* rays, int nrays, bool* occluded);
+
 // intersects the scene's surfaces and return the first intrerseciton (used for raytracing homework)
 intersection3f intersect_surfaces(Scene* scene, ray3f ray);
 
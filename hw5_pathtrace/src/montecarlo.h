@@ -3,55 +3,143 @@
 
 #include "vmath.h"
 
-#include <random>
+#include <cstdint>
+#include <algorithm>
 
-// Random number generator
+// mix the bits of a 64 bit integer (splitmix64 finalizer)
+inline uint64_t rng_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// map 32 random bits to a float in the open interval (0,1), at the centers of 2^23
+// strata, so that samples never hit 0 or 1 where sampling pdfs vanish (the half
+// offset is exact in a float only with 23 bits, while 24 bits would round to 1)
+inline float rng_unit_float(uint32_t x) {
+    return ((x >> 9) + 0.5f) * (1.0f / (1 << 23));
+}
+
+// reverse the bits of a 32 bit integer
+inline uint32_t rng_reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// owen scramble a 32 bit fixed point number in [0,1), flipping each bit by a hash
+// of the bits above it (laine-karras style hash on the reversed bits)
+inline uint32_t rng_owen_scramble(uint32_t x, uint32_t seed) {
+    x = rng_reverse_bits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return rng_reverse_bits(x);
+}
+
+// second dimension of the sobol sequence, as a 32 bit fixed point number
+// (the first one is the index with reversed bits)
+inline uint32_t rng_sobol2(uint32_t index) {
+    auto x = 0u;
+    for(auto v = 1u << 31; index; index >>= 1, v ^= v >> 1) if(index & 1) x ^= v;
+    return x;
+}
+
+// scrambled radical inverse of index in a prime base, permuting each digit by
+// a shift hashed from the seed and the digits before it
+inline float rng_halton(uint32_t index, uint32_t base, uint64_t seed) {
+    auto inv = 1.0 / base, f = inv, x = 0.0;
+    while(f > 1e-9) {
+        auto digit = index % base;
+        index /= base;
+        x += ((digit + rng_mix(seed)) % base) * f;
+        seed = rng_mix(seed + digit + 1);
+        f *= inv;
+    }
+    return clamp((float)x, 1.0f / (1 << 25), 1 - 1.0f / (1 << 24));
+}
+
+#define rng_sampler_random 0    // independent uniform numbers
+#define rng_sampler_sobol 1     // owen scrambled sobol (0,2)-sequence, padded by dimension pairs
+#define rng_sampler_halton 2    // scrambled halton sequence (random past rng_halton_dims)
+#define rng_sampler_r2 3        // r2 rank-1 lattice, rotated for each pixel and dimension pair
+
+#define rng_halton_dims 64
+
+// Counter-based random number generator: the numbers hash the generator key
+// with their dimension, i.e. the count of numbers drawn so far, so a generator
+// keyed by (seed, pixel, sample) draws the same numbers in any thread or order;
+// the low-discrepancy samplers instead draw the sample-th point of a sequence in
+// each dimension, decorrelated across pixels by the pixel key
 struct Rng {
-    // C++11 random number engine
-    std::minstd_rand                        engine;
+    uint64_t    pixel_key = 0;  // pixel key, scrambling the low-discrepancy sequences
+    uint64_t    key = 0;        // generator key
+    uint64_t    dim = 0;        // dimension of the next number
+    uint32_t    sample = 0;     // sample index in the low-discrepancy sequences
+    int         sampler = rng_sampler_random;   // sampler of next_float
+    
+    // Default constructor
+    Rng() { }
+    // Key constructor
+    Rng(unsigned int seed, unsigned int pixel, unsigned int sample, int sampler = rng_sampler_random) :
+        pixel_key(rng_mix(rng_mix(seed + 0x9e3779b97f4a7c15ull) ^ pixel)), key(rng_mix(pixel_key ^ sample)),
+        sample(sample), sampler(sampler) { }
     
     // Seed the generator
-    void seed(unsigned int seed) { engine.seed(seed); }
+    void seed(unsigned int seed) { pixel_key = key = rng_mix(seed + 0x9e3779b97f4a7c15ull); dim = 0; }
+    
+    // Generate a 32 bit integer
+    uint32_t next_uint() { return (uint32_t)(rng_mix(key + (++dim) * 0x9e3779b97f4a7c15ull) >> 32); }
 	
     // Generate a float in [0,1)
-	float next_float() { return std::uniform_real_distribution<float>(0,1)(engine); }
+	float next_float() {
+        auto pair = dim / 2;
+        auto axis = (uint32_t)(dim % 2);
+        switch(sampler) {
+            case rng_sampler_sobol: {
+                // shuffle the points by an owen scramble of the index, for each pair
+                auto seed = (uint32_t)rng_mix(pixel_key + (pair+1) * 0x9e3779b97f4a7c15ull);
+                auto index = rng_owen_scramble(sample, seed);
+                auto x = (axis == 0) ? rng_reverse_bits(index) : rng_sobol2(index);
+                x = rng_owen_scramble(x, (uint32_t)rng_mix(seed + axis + 1));
+                dim ++;
+                return rng_unit_float(x);
+            }
+            case rng_sampler_halton: {
+                static const uint32_t primes[rng_halton_dims] = {
+                    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+                    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+                    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311 };
+                if(dim >= rng_halton_dims) break;
+                auto base = primes[dim];
+                return rng_halton(sample, base, pixel_key + (++dim) * 0x9e3779b97f4a7c15ull);
+            }
+            case rng_sampler_r2: {
+                // the r2 steps are the inverse powers of the plastic number
+                auto alpha = (axis == 0) ? 0.7548776662466927 : 0.5698402909980532;
+                auto offset = (rng_mix(pixel_key + (pair+1) * 0x9e3779b97f4a7c15ull) >> (32*axis)) & 0xffffffffull;
+                auto x = offset / 4294967296.0 + alpha * (sample + 1);
+                dim ++;
+                return clamp((float)(x - floor(x)), 1.0f / (1 << 25), 1 - 1.0f / (1 << 24));
+            }
+        }
+        return rng_unit_float(next_uint());
+    }
     // Generate a float in [v.x,v.y)
-	float next_float(const vec2f& v) { return std::uniform_real_distribution<float>(v.x,v.y)(engine); }
+	float next_float(const vec2f& v) { return v.x + (v.y - v.x) * next_float(); }
     
-	// Generate 2 floats in [0,1)^2
-    vec2f next_vec2f() { return vec2f(next_float(),next_float()); }
+	// Generate 2 floats in [0,1)^2, from a pair of dimensions
+    vec2f next_vec2f() { dim += dim % 2; return vec2f(next_float(),next_float()); }
 	// Generate 3 floats in [0,1)^3
     vec3f next_vec3f() { return vec3f(next_float(),next_float(),next_float()); }
     
-    // Generate an int in [v.x,v.y)
-    int next_int(const vec2i& v) { return std::uniform_int_distribution<int>(v.x,v.y)(engine); }
-    
-    // Create and seed nrngs generators
-    static std::vector<Rng> generate_seeded(int nrngs) {
-        std::seed_seq sseq{0,1,2,3,4,5,6,7,8,9};
-        auto seeds = std::vector<int>(nrngs);
-        sseq.generate(seeds.begin(), seeds.end());
-        auto rngs = std::vector<Rng>(nrngs);
-        for(int i = 0; i < nrngs; i ++) {
-            rngs[i].seed(seeds[i]);
-        }
-        return rngs;
-    }
-};
-
-// A set of per-pixel randon number generators seeded automatically
-struct RngImage {
-    // Default constructor
-    RngImage() : _w(0), _h(0) { }
-    // Size Constructor (sets width and height)
-	RngImage(int w, int h) : _w(w), _h(h), _d(Rng::generate_seeded(w*h)) { }
-    
-    // element access
-	Rng& at(int i, int j) { return _d[j*_w+i]; }
-    
-private:
-	int _w, _h;
-	vector<Rng> _d;
+    // Generate an int in [v.x,v.y]
+    int next_int(const vec2i& v) { return v.x + (int)(((uint64_t)next_uint() * (uint64_t)(v.y - v.x + 1)) >> 32); }
 };
 
 // hemispherical direction with uniform distribution
@@ -116,6 +204,125 @@ inline float sample_index_uniform_pdf(int size) {
     return 1.0f / size;
 }
 
+// discrete distribution over indices proportional to weights, sampled in
+// constant time with a single random number by the alias method
+struct AliasTable {
+    vector<float>   prob;       // probability of keeping each slot, instead of its alias
+    vector<int>     alias;      // alias of each slot
+    vector<float>   pdf;        // probability of each index
+    
+    // Default constructor
+    AliasTable() { }
+    // Weights constructor (builds the table by Vose's method; zero weights give a uniform distribution)
+    explicit AliasTable(const vector<float>& weights) : prob(weights.size()), alias(weights.size()), pdf(weights.size()) {
+        auto size = (int)weights.size();
+        auto total = 0.0f;
+        for(auto w : weights) total += w;
+        for(auto i : range(size)) pdf[i] = (total > 0) ? weights[i] / total : 1.0f / size;
+        // split the slots into the ones below and above the average, pairing them up
+        auto small = vector<int>(), large = vector<int>();
+        auto scaled = vector<float>(size);
+        for(auto i : range(size)) {
+            scaled[i] = pdf[i] * size;
+            if(scaled[i] < 1) small.push_back(i); else large.push_back(i);
+        }
+        while(not small.empty() and not large.empty()) {
+            auto s = small.back(); small.pop_back();
+            auto l = large.back(); large.pop_back();
+            prob[s] = scaled[s]; alias[s] = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1;
+            if(scaled[l] < 1) small.push_back(l); else large.push_back(l);
+        }
+        // the remaining slots are full, up to round-off
+        for(auto i : large) { prob[i] = 1; alias[i] = i; }
+        for(auto i : small) { prob[i] = 1; alias[i] = i; }
+    }
+    
+    // number of indices
+    int size() const { return prob.size(); }
+    
+    // sample an index with a random number in [0,1), returning it with its pdf
+    int sample(float r, float& p) const {
+        auto slot = sample_index_uniform(r, size());
+        auto u = r * size() - slot;
+        auto i = (u < prob[slot]) ? slot : alias[slot];
+        p = pdf[i];
+        return i;
+    }
+};
+
+// piecewise constant distribution over [0,1) proportional to weights,
+// sampled by inverting its cdf
+struct Distribution1D {
+    vector<float>   func;       // weights, normalized to average 1 (i.e. the pdf of each piece)
+    vector<float>   cdf;        // cumulative distribution, with size()+1 entries
+    float           total = 0;  // sum of the weights
+    
+    // Default constructor
+    Distribution1D() { }
+    // Weights constructor (zero weights give a uniform distribution)
+    explicit Distribution1D(const vector<float>& weights) : func(weights.size()), cdf(weights.size()+1) {
+        auto size = (int)weights.size();
+        for(auto w : weights) total += w;
+        cdf[0] = 0;
+        for(auto i : range(size)) {
+            func[i] = (total > 0) ? weights[i] * size / total : 1;
+            cdf[i+1] = cdf[i] + func[i] / size;
+        }
+        cdf[size] = 1;
+    }
+    
+    // number of pieces
+    int size() const { return func.size(); }
+    
+    // sample a value in [0,1) with a random number, returning its piece and pdf
+    float sample(float r, int& idx, float& pdf) const {
+        idx = clamp((int)(std::upper_bound(cdf.begin(), cdf.end(), r) - cdf.begin()) - 1, 0, size()-1);
+        pdf = func[idx];
+        auto du = (cdf[idx+1] > cdf[idx]) ? (r - cdf[idx]) / (cdf[idx+1] - cdf[idx]) : 0.5f;
+        return min((idx + du) / size(), 1 - 1e-6f);
+    }
+    
+    // pdf of a value in [0,1)
+    float pdf(float u) const { return func[clamp((int)(u * size()), 0, size()-1)]; }
+};
+
+// piecewise constant distribution over [0,1)^2 proportional to a width x height grid
+// of weights, sampled by the marginal distribution of the rows, then the conditional
+// distribution in the row
+struct Distribution2D {
+    vector<Distribution1D>  conditional;    // distribution in each row
+    Distribution1D          marginal;       // distribution of the rows
+    
+    // Default constructor
+    Distribution2D() { }
+    // Weights constructor (weights stored by rows)
+    Distribution2D(const vector<float>& weights, int width, int height) {
+        auto rows = vector<float>(height);
+        for(auto j : range(height)) {
+            conditional.push_back(Distribution1D(vector<float>(weights.begin()+j*width, weights.begin()+(j+1)*width)));
+            rows[j] = conditional.back().total;
+        }
+        marginal = Distribution1D(rows);
+    }
+    
+    // sample a point in [0,1)^2 with two random numbers, returning its pdf
+    vec2f sample(const vec2f& ruv, float& pdf) const {
+        auto j = 0, i = 0;
+        auto pdf_v = 0.0f, pdf_u = 0.0f;
+        auto v = marginal.sample(ruv.y, j, pdf_v);
+        auto u = conditional[j].sample(ruv.x, i, pdf_u);
+        pdf = pdf_u * pdf_v;
+        return vec2f(u, v);
+    }
+    
+    // pdf of a point in [0,1)^2
+    float pdf(const vec2f& uv) const {
+        auto j = clamp((int)(uv.y * marginal.size()), 0, marginal.size()-1);
+        return marginal.func[j] * conditional[j].pdf(uv.x);
+    }
+};
+
 // computes the sample number in each dimension for stratified sampling
 inline int sample_stratify_samplesnumber(int samples) {
     return (int)round(sqrt(samples));
@@ -128,6 +335,11 @@ inline vec2f sample_stratify_sample(const vec2f& uv, int sample, int samples_x,
     return vec2f((sample_x + uv.x / samples_x), (sample_y + uv.y / samples_y));
 }
 
+// balance distribution heuristics
+inline float sample_balance_heuristics(float fPdf, float gPdf) {
+    return fPdf / (fPdf + gPdf);
+}
+
 // power distribution heuristics
 inline float sample_power_heuristics(float fPdf, float gPdf) {
     return (fPdf*fPdf) / (fPdf*fPdf + gPdf*gPdf);
@@ -3,51 +3,70 @@
 #include "montecarlo.h"
 
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <random>
+#include <algorithm>
 using std::thread;
 
-// lookup texture value
-vec3f lookup_scaled_texture(vec3f value, image3f* texture, vec2f uv, bool tile = false) {
+// lookup texture value at a mip level, interpolating bilinearly
+vec3f lookup_texture_level(texture3f* texture, int level, vec2f uv, bool tile) {
     // YOUR CODE GOES HERE ----------------------
-    if (texture == nullptr) {
-        return value; // placeholder
-    }
-    int i = (int) uv.x * texture->width();
-    float s = uv.x * texture->width() - i;
+    auto width = texture->width(level), height = texture->height(level);
+    int i = (int) floor(uv.x * width);
+    float s = uv.x * width - i;
     int i1 = i + 1;
     
-    int j = (int) uv.y * texture->height();
-    float t = uv.y * texture->height() - j;
+    int j = (int) floor(uv.y * height);
+    float t = uv.y * height - j;
     int j1 = j + 1;
     
     if (tile) {
-        i %= texture->width();
-        i1 %= texture->width();
+        i %= width;
+        i1 %= width;
         if (i < 0) {
-            i += texture->width();
+            i += width;
         }
         if (i1 < 0) {
-            i1 += texture->width();
+            i1 += width;
         }
         
-        j %= texture->height();
-        j1 %= texture->height();
+        j %= height;
+        j1 %= height;
         if (j < 0) {
-            j += texture->height();
+            j += height;
         }
         if(j1 < 0) {
-            j += texture->height();
+            j1 += height;
         }
     }
     else {
-        i = clamp(i, 0, texture->width()-1);
-        i1 = clamp(i1, 0, texture->width()-1);
-        j = clamp(j, 0, texture->height()-1);
-        j1 = clamp(j1, 0, texture->height()-1);
+        i = clamp(i, 0, width-1);
+        i1 = clamp(i1, 0, width-1);
+        j = clamp(j, 0, height-1);
+        j1 = clamp(j1, 0, height-1);
+    }
+    return texture->at(level, i, j) * (1 - s) * (1 - t) +
+           texture->at(level, i, j1) * (1 - s) * t +
+           texture->at(level, i1, j) * s * (1 - t) +
+           texture->at(level, i1, j1) * s * t;
+}
+
+// lookup texture value, filtering it over a footprint of the given size in texture
+// coordinates by blending the two mip levels whose texels are closest to it in size
+vec3f lookup_scaled_texture(vec3f value, texture3f* texture, vec2f uv, bool tile = false, float footprint = 0) {
+    if (texture == nullptr) {
+        return value;
     }
-    return texture->at(i, j) * (1 - s) * (1 - t) +
-           texture->at(i, j1) * (1 - s) * t +
-           texture->at(i1, j) * s * (1 - t) +
-           texture->at(i1, j1) * s * t;
+    auto lod = (footprint > 0) ? log2(footprint * max(texture->width(), texture->height())) : 0.0f;
+    lod = clamp(lod, 0.0f, (float)(texture->levels()-1));
+    auto level = (int)lod;
+    auto t = lod - level;
+    if(t <= 0 or level+1 >= texture->levels()) return lookup_texture_level(texture, level, uv, tile);
+    return lookup_texture_level(texture, level, uv, tile) * (1 - t) +
+           lookup_texture_level(texture, level+1, uv, tile) * t;
 }
 
 // compute the brdf
@@ -67,7 +86,7 @@ vec3f eval_brdf(vec3f kd, vec3f ks, float n, vec3f v, vec3f l, vec3f norm, bool
 }
 
 // evaluate the environment map
-vec3f eval_env(vec3f ke, image3f* ke_txt, vec3f dir) {
+vec3f eval_env(vec3f ke, texture3f* ke_txt, vec3f dir) {
     // YOUR CODE GOES HERE ----------------------
     if(not ke_txt) return zero3f;
     
@@ -76,6 +95,46 @@ vec3f eval_env(vec3f ke, image3f* ke_txt, vec3f dir) {
     return lookup_scaled_texture(ke, ke_txt, vec2f(u, v), true);
 }
 
+// build the distribution sampling the environment map, over the cells between its texels
+// where the lookup interpolates, weighted by their mean value and by sin(theta) to account
+// for the lat-long area distortion
+void make_env_distribution(Scene* scene) {
+    scene->background_distribution = Distribution2D();
+    if(not scene->path_env_sampling or not scene->background_txt) return;
+    auto txt = scene->background_txt;
+    auto w = txt->width(), h = txt->height();
+    auto weights = vector<float>(w*h);
+    for(auto j : range(h)) {
+        auto sin_theta = sin(pif * (j + 0.5f) / h);
+        for(auto i : range(w)) {
+            auto c = txt->at(i,j) + txt->at((i+1)%w,j) + txt->at(i,(j+1)%h) + txt->at((i+1)%w,(j+1)%h);
+            weights[j*w+i] = mean(c) / 4 * sin_theta;
+        }
+    }
+    scene->background_distribution = Distribution2D(weights, w, h);
+}
+
+// pick a direction according to the environment map distribution (returns direction and its pdf)
+pair<vec3f,float> sample_env(Scene* scene, vec2f ruv) {
+    auto pdf_uv = 0.0f;
+    auto uv = scene->background_distribution.sample(ruv, pdf_uv);
+    auto phi = 2 * pif * uv.x, theta = pif * (1 - uv.y);
+    auto sin_theta = sin(theta);
+    if(sin_theta <= 0) return {z3f,0};
+    auto l = vec3f(sin_theta * sin(phi), cos(theta), sin_theta * cos(phi));
+    return {l, pdf_uv / (2 * pif * pif * sin_theta)};
+}
+
+// compute the pdf of picking the direction dir by sample_env
+float sample_env_pdf(Scene* scene, vec3f dir) {
+    auto u = atan2(dir.x, dir.z) / (2 * pif);
+    if(u < 0) u += 1;
+    auto theta = acos(clamp(dir.y, -1.0f, 1.0f));
+    auto sin_theta = sin(theta);
+    if(sin_theta <= 0) return 0;
+    return scene->background_distribution.pdf(vec2f(u, 1 - theta / pif)) / (2 * pif * pif * sin_theta);
+}
+
 // pick a direction according to the cosine (returns direction and its pdf)
 pair<vec3f,float> sample_cosine(vec3f norm, vec2f ruv) {
     auto frame = frame_from_z(norm);
@@ -106,97 +165,428 @@ pair<vec3f,float> sample_brdf(vec3f kd, vec3f ks, float n, vec3f v, vec3f norm,
     return {l,pdf};
 }
 
-// compute the color corresponing to a ray by pathtrace
-vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
-    // get scene intersection
-    auto intersection = intersect(scene,ray);
-    
-    // if not hit, return background (looking up the texture by converting the ray direction to latlong around y)
-    if(not intersection.hit) {
-        // YOUR CODE GOES HERE ----------------------
-        return eval_env(scene->background, scene->background_txt, ray.d);
-    }
-    
+// compute the pdf of picking the direction l by sample_brdf
+float sample_brdf_pdf(vec3f kd, vec3f ks, float n, vec3f v, vec3f l, vec3f norm) {
+    auto frame = frame_from_z(norm);
+    auto l_local = transform_direction_inverse(frame, l);
+    auto dpdf = sample_direction_hemispherical_cosine_pdf(l_local);
+    if(ks == zero3f) return dpdf;
+    auto dw = mean(kd) / (mean(kd) + mean(ks));
+    auto v_local = transform_direction_inverse(frame, v);
+    auto h_local = normalize(l_local+v_local);
+    auto vh = dot(v_local,h_local);
+    auto spdf = (vh > 0) ? sample_direction_hemispherical_cospower_pdf(h_local,n) / (4*vh) : 0;
+    return dw * dpdf + (1-dw) * spdf;
+}
+
+// ray cone bounding the footprint of a path, for texture filtering
+struct RayCone {
+    float       width = 0;  // width at the ray origin
+    float       spread = 0; // spread angle
+};
+
+// ray cone of the camera rays, spreading over a pixel
+RayCone make_camera_cone(Scene* scene) {
+    auto cone = RayCone();
+    cone.spread = scene->camera->height / scene->image_height;
+    return cone;
+}
+
+// surface point to be shaded, with material values looked up from textures
+struct ShadePoint {
+    vec3f       pos;        // position
+    vec3f       norm;       // shading normal
+    vec3f       v;          // outgoing direction
+    vec3f       ke;         // emission
+    vec3f       kd;         // diffuse coefficient
+    vec3f       ks;         // specular coefficient
+    float       n;          // specular exponent
+    bool        mf;         // microfacet model
+    RayCone     cone;       // ray cone reaching the point
+};
+
+// setup the shading point for a ray intersection, filtering the textures over the
+// footprint of the ray cone, stretched by the incidence angle
+ShadePoint make_shadepoint(const intersection3f& intersection, const ray3f& ray, const RayCone& cone) {
     // setup variables for shorter code
-    auto pos = intersection.pos;
-    auto norm = intersection.norm;
-    auto v = -ray.d;
+    auto sp = ShadePoint();
+    sp.pos = intersection.pos;
+    sp.norm = intersection.norm;
+    sp.v = -ray.d;
+    sp.cone.width = cone.width + cone.spread * intersection.ray_t;
+    sp.cone.spread = cone.spread;
+    auto footprint = sp.cone.width / max(fabs(dot(intersection.norm, ray.d)), 0.01f) * intersection.texcoord_scale;
     
     // compute material values by looking up textures
     // YOUR CODE GOES HERE ----------------------
-    auto ke = intersection.mat->ke;
-    auto kd = intersection.mat->kd;
-    auto ks = intersection.mat->ks;
-    auto n = intersection.mat->n;
-    auto mf = intersection.mat->microfacet;
+    sp.ke = intersection.mat->ke;
+    sp.kd = intersection.mat->kd;
+    sp.ks = intersection.mat->ks;
+    sp.n = intersection.mat->n;
+    sp.mf = intersection.mat->microfacet;
     
     vec2f uv = intersection.texcoord;
-    ke = lookup_scaled_texture(ke, intersection.mat->ke_txt, uv);
-    kd = lookup_scaled_texture(kd, intersection.mat->kd_txt, uv);
-    ks = lookup_scaled_texture(ks, intersection.mat->ks_txt, uv);
-    norm = lookup_scaled_texture(norm, intersection.mat->norm_txt, uv);
-    // accumulate color starting with ambient
-    auto c = scene->ambient * kd;
-    
-    // add emission if on the first bounce
-    // YOUR CODE GOES HERE ----------------------
-    if (depth == 0) {
-        c += ke;
+    sp.ke = lookup_scaled_texture(sp.ke, intersection.mat->ke_txt, uv, false, footprint);
+    sp.kd = lookup_scaled_texture(sp.kd, intersection.mat->kd_txt, uv, false, footprint);
+    sp.ks = lookup_scaled_texture(sp.ks, intersection.mat->ks_txt, uv, false, footprint);
+    sp.norm = lookup_scaled_texture(sp.norm, intersection.mat->norm_txt, uv, false, footprint);
+    return sp;
+}
+
+// ray cone continuing a path from a shading point along a direction picked with
+// the given pdf, spreading at least over the solid angle the sample stands for
+RayCone make_bounce_cone(const ShadePoint& sp, float pdf) {
+    auto cone = sp.cone;
+    if(pdf > 0) cone.spread = max(cone.spread, 1 / sqrt(pdf));
+    return cone;
+}
+
+// merge two light bvh nodes bounds, i.e. their boxes, their normal cones and their power
+LightNode merge_light_nodes(const LightNode& a, const LightNode& b) {
+    auto node = LightNode();
+    node.bbox = runion(a.bbox, b.bbox);
+    node.power = a.power + b.power;
+    // the cone of a bounds the one of b, after swapping them if needed
+    auto& ca = (a.theta >= b.theta) ? a : b;
+    auto& cb = (a.theta >= b.theta) ? b : a;
+    auto theta_d = acos(clamp(dot(ca.axis, cb.axis), -1.0f, 1.0f));
+    if(min(theta_d + cb.theta, pif) <= ca.theta) { node.axis = ca.axis; node.theta = ca.theta; return node; }
+    // else the merged cone spans both, rotating the axis of a towards b
+    auto theta = (ca.theta + theta_d + cb.theta) / 2;
+    if(theta >= pif) { node.axis = z3f; node.theta = pif; return node; }
+    auto ortho = normalize(cb.axis - ca.axis * dot(ca.axis, cb.axis));
+    auto theta_r = theta - ca.theta;
+    node.axis = normalize(ca.axis * cos(theta_r) + ortho * sin(theta_r));
+    node.theta = theta;
+    return node;
+}
+
+// build the light bvh over the leaves from start to end, splitting them at the
+// median of their centers along the largest axis; returns the node index
+int make_emitters_node(Scene* scene, vector<LightNode>& leaves, int start, int end) {
+    auto nodeid = (int)scene->emitters_bvh.size();
+    if(end - start == 1) { scene->emitters_bvh.push_back(leaves[start]); return nodeid; }
+    scene->emitters_bvh.push_back(LightNode());
+    auto centers = range3f();
+    for(auto i : range(start, end)) centers = runion(centers, center(leaves[i].bbox));
+    auto axis = (size(centers).x >= size(centers).y and size(centers).x >= size(centers).z) ? 0 :
+                (size(centers).y >= size(centers).z) ? 1 : 2;
+    auto middle = (start + end) / 2;
+    std::nth_element(leaves.begin()+start, leaves.begin()+middle, leaves.begin()+end,
+                     [axis](const LightNode& a, const LightNode& b){ return center(a.bbox)[axis] < center(b.bbox)[axis]; });
+    auto left = make_emitters_node(scene, leaves, start, middle);
+    auto right = make_emitters_node(scene, leaves, middle, end);
+    auto node = merge_light_nodes(scene->emitters_bvh[left], scene->emitters_bvh[right]);
+    node.left = left; node.right = right;
+    scene->emitters_bvh[left].parent = nodeid;
+    scene->emitters_bvh[right].parent = nodeid;
+    scene->emitters_bvh[nodeid] = node;
+    return nodeid;
+}
+
+// estimate the contribution of the emitters of a light bvh node at a shading point,
+// bounding from above the angles between the node normals cone, the direction from
+// the node to the point and the point normal (the emitters emit in a hemisphere)
+float eval_light_node_importance(const LightNode& node, const vec3f& pos, const vec3f& norm) {
+    auto c = center(node.bbox);
+    auto radius = length(size(node.bbox)) / 2;
+    auto dist2 = lengthSqr(pos - c);
+    // the points inside the bounds receive light from all directions
+    if(dist2 <= radius*radius) return node.power / max(dist2, radius*radius*0.25f);
+    auto dist = sqrt(dist2);
+    auto d = (pos - c) / dist;
+    auto theta_u = asin(radius / dist);
+    auto cos_emit = 1.0f;
+    if(node.theta < pif) {
+        auto theta = acos(clamp(dot(node.axis, d), -1.0f, 1.0f));
+        auto theta_e = max(0.0f, theta - node.theta - theta_u);
+        if(theta_e >= pif/2) return 0;
+        cos_emit = cos(theta_e);
     }
-    
-    // foreach point light
+    auto theta_i = max(0.0f, (float)acos(clamp(dot(norm, -d), -1.0f, 1.0f)) - theta_u);
+    if(theta_i >= pif/2) return 0;
+    return node.power * cos_emit * cos(theta_i) / dist2;
+}
+
+// pick an emitter by traversing the light bvh from the root, choosing each child with
+// probability proportional to its importance at the shading point and reusing the
+// random number r; returns -1 if no emitter contributes
+int sample_emitters_bvh(Scene* scene, const vec3f& pos, const vec3f& norm, float r, float& pdf) {
+    pdf = 1;
+    auto nodeid = 0;
+    while(scene->emitters_bvh[nodeid].emitter < 0) {
+        auto& node = scene->emitters_bvh[nodeid];
+        auto wl = eval_light_node_importance(scene->emitters_bvh[node.left], pos, norm);
+        auto wr = eval_light_node_importance(scene->emitters_bvh[node.right], pos, norm);
+        if(wl + wr <= 0) return -1;
+        auto pl = wl / (wl + wr);
+        if(r < pl) { nodeid = node.left; pdf *= pl; r = min(r / pl, 1 - 1e-6f); }
+        else { nodeid = node.right; pdf *= 1 - pl; r = min((r - pl) / (1 - pl), 1 - 1e-6f); }
+    }
+    return scene->emitters_bvh[nodeid].emitter;
+}
+
+// compute the pdf of picking an emitter by sample_emitters_bvh, walking up from its leaf
+float sample_emitters_bvh_pdf(Scene* scene, const vec3f& pos, const vec3f& norm, int idx) {
+    auto pdf = 1.0f;
+    auto nodeid = scene->emitters[idx].node;
+    while(scene->emitters_bvh[nodeid].parent >= 0) {
+        auto parentid = scene->emitters_bvh[nodeid].parent;
+        auto& parent = scene->emitters_bvh[parentid];
+        auto wl = eval_light_node_importance(scene->emitters_bvh[parent.left], pos, norm);
+        auto wr = eval_light_node_importance(scene->emitters_bvh[parent.right], pos, norm);
+        if(wl + wr <= 0) return 0;
+        pdf *= ((nodeid == parent.left) ? wl : wr) / (wl + wr);
+        nodeid = parentid;
+    }
+    return pdf;
+}
+
+// compute the pdf of picking an emitter for a light sample at a shading point,
+// scaled by the number of light samples (1 if each emitter is taken in turn)
+float sample_emitter_pdf(Scene* scene, const vec3f& pos, const vec3f& norm, int idx) {
+    if(scene->path_light_samples <= 0) return 1;
+    auto pdf = (scene->_light_sampling == path_light_sampling_bvh) ? sample_emitters_bvh_pdf(scene, pos, norm, idx) :
+                                                        scene->emitters_table.pdf[idx];
+    return pdf * scene->path_light_samples;
+}
+
+// geometric normal of a triangle of a mesh instance in world space, facing as its vertex normals
+vec3f mesh_triangle_normal(Mesh* instance, int tid) {
+    auto mesh = mesh_shape(instance);
+    auto triangle = mesh->triangle[tid];
+    auto v0 = mesh->pos[triangle.x], v1 = mesh->pos[triangle.y], v2 = mesh->pos[triangle.z];
+    auto ng = normalize(cross(v1-v0, v2-v0));
+    if(not mesh->norm.empty() and
+       dot(ng, mesh->norm[triangle.x]+mesh->norm[triangle.y]+mesh->norm[triangle.z]) < 0) ng = -ng;
+    return transform_normal(instance->frame, ng);
+}
+
+// normal of the point hit on an emitter, as used by its light samples, i.e. the
+// geometric normal for meshes, since the shading normal differs on smooth ones
+vec3f emitter_normal(Scene* scene, const intersection3f& hit) {
+    auto& emitter = scene->emitters[hit.emitter];
+    if(emitter.mesh and hit.triangle >= 0) return mesh_triangle_normal(emitter.mesh, hit.triangle);
+    return hit.norm;
+}
+
+// compute the pdf in solid angle of sampling the point hit on an emitter, seen from pos
+// along l, as picked by pathtrace_direct (excluding the emitter pick)
+float sample_emitter_point_pdf(Scene* scene, const vec3f& pos, const vec3f& l, const intersection3f& hit) {
+    auto& emitter = scene->emitters[hit.emitter];
+    // spheres are sampled uniformly in the cone they subtend
+    if(emitter.surface and not emitter.surface->isquad) {
+        auto r = emitter.surface->radius;
+        auto dist2 = lengthSqr(emitter.surface->frame.o - pos);
+        if(dist2 <= r*r) return 0;
+        auto cos_max = sqrt(max(0.0f, 1 - r*r/dist2));
+        return 1 / (2*pif*(1-cos_max));
+    }
+    // quads and meshes are sampled uniformly in area
+    auto area = (emitter.mesh) ? emitter.area : 4 * emitter.surface->radius * emitter.surface->radius;
+    auto cos_l = -dot(emitter_normal(scene, hit), l);
+    if(cos_l <= 0) return 0;
+    return hit.ray_t * hit.ray_t / (cos_l * area);
+}
+
+// weight a sample by the multiple importance sampling heuristic, given its pdf
+// and the one of the other strategy for the same direction
+float pathtrace_mis_weight(Scene* scene, float pdf, float other_pdf) {
+    if(scene->_mis == path_mis_balance) return sample_balance_heuristics(pdf, other_pdf);
+    return sample_power_heuristics(pdf, other_pdf);
+}
+
+// collect the emitters sampled for direct illumination, i.e. the point lights, the
+// emissive surfaces and meshes, and build the distribution and the light bvh picking them
+void make_emitters(Scene* scene) {
+    scene->emitters.clear();
+    for(auto surface : scene->surfaces) surface->_emitter = -1;
+    for(auto mesh : scene->meshes) mesh->_emitter = -1;
+    auto power = vector<float>();
     for(auto light : scene->lights) {
-        // compute light response
-        auto cl = light->intensity / (lengthSqr(light->frame.o - pos));
-        // compute light direction
-        auto l = normalize(light->frame.o - pos);
-        // compute the material response (brdf*cos)
-        auto brdfcos = max(dot(norm,l),0.0f) * eval_brdf(kd, ks, n, v, l, norm, mf);
-        // multiply brdf and light
-        auto shade = cl * brdfcos;
-        // check for shadows and accumulate if needed
-        if(shade == zero3f) continue;
-        // if shadows are enabled
-        if(scene->path_shadows) {
-            // perform a shadow check and accumulate
-            if(not intersect_shadow(scene,ray3f::make_segment(pos,light->frame.o))) c += shade;
+        auto emitter = Emitter();
+        emitter.light = light;
+        emitter.power = 4 * pif * mean(light->intensity);
+        scene->emitters.push_back(emitter);
+    }
+    for(auto surface : scene->surfaces) {
+        if(surface->mat->ke == zero3f) continue;
+        auto emitter = Emitter();
+        emitter.surface = surface;
+        auto area = (surface->isquad) ? 4 * surface->radius * surface->radius : 4 * pif * surface->radius * surface->radius;
+        emitter.power = pif * area * mean(surface->mat->ke);
+        surface->_emitter = scene->emitters.size();
+        scene->emitters.push_back(emitter);
+    }
+    for(auto mesh : scene->meshes) {
+        auto shape = mesh_shape(mesh);
+        if(mesh->mat->ke == zero3f or shape->triangle.empty()) continue;
+        auto emitter = Emitter();
+        emitter.mesh = mesh;
+        auto areas = vector<float>();
+        for(auto f : shape->triangle) {
+            areas.push_back(length(cross(shape->pos[f.y]-shape->pos[f.x], shape->pos[f.z]-shape->pos[f.x])) / 2);
+            emitter.area += areas.back();
+        }
+        if(emitter.area <= 0) continue;
+        emitter.triangles = AliasTable(areas);
+        emitter.power = pif * emitter.area * mean(mesh->mat->ke);
+        mesh->_emitter = scene->emitters.size();
+        scene->emitters.push_back(emitter);
+    }
+    for(auto& emitter : scene->emitters) power.push_back(emitter.power);
+    scene->emitters_table = AliasTable(power);
+    
+    // make the light bvh leaves, bounding the emitters and their normals
+    scene->emitters_bvh.clear();
+    if(scene->emitters.empty()) return;
+    auto leaves = vector<LightNode>(scene->emitters.size());
+    for(auto i : range(scene->emitters.size())) {
+        auto& emitter = scene->emitters[i];
+        auto& leaf = leaves[i];
+        leaf.emitter = i;
+        leaf.power = emitter.power;
+        if(emitter.light) leaf.bbox = range3f(emitter.light->frame.o, emitter.light->frame.o);
+        else if(emitter.mesh) {
+            auto bbox = range3f();
+            for(auto p : mesh_shape(emitter.mesh)->pos) bbox = runion(bbox, p);
+            for(auto p : corners(bbox)) leaf.bbox = runion(leaf.bbox, transform_point(emitter.mesh->frame, p));
+        } else if(not emitter.surface->isquad) {
+            auto r = emitter.surface->radius;
+            leaf.bbox = range3f(emitter.surface->frame.o - vec3f(r,r,r), emitter.surface->frame.o + vec3f(r,r,r));
         } else {
-            // else just accumulate
-            c += shade;
+            auto surface = emitter.surface;
+            auto r = surface->radius;
+            for(auto p : { vec3f(-r,-r,0), vec3f(r,-r,0), vec3f(-r,r,0), vec3f(r,r,0) })
+                leaf.bbox = runion(leaf.bbox, transform_point(surface->frame, p));
+            leaf.axis = transform_normal(surface->frame, z3f);
+            leaf.theta = 0;
         }
     }
+    make_emitters_node(scene, leaves, 0, leaves.size());
+    for(auto i : range(scene->emitters_bvh.size())) {
+        if(scene->emitters_bvh[i].emitter >= 0) scene->emitters[scene->emitters_bvh[i].emitter].node = i;
+    }
+}
+
+// sample the direct illumination from point, area and environment lights at a shading point;
+// each light sample is handed to connect with its shadow ray, to be accumulated if visible;
+// with path_mis, area lights are also reached by a brdf sample, weighting both strategies
+template<typename connect_func>
+void pathtrace_direct(Scene* scene, const ShadePoint& sp, Rng* rng, const connect_func& connect) {
+    // setup variables for shorter code
+    auto pos = sp.pos; auto norm = sp.norm; auto v = sp.v;
+    auto kd = sp.kd; auto ks = sp.ks; auto n = sp.n; auto mf = sp.mf;
     
-    // YOUR AREA LIGHT CODE GOES HERE ----------------------
-    // foreach surface
-    for (Surface* surface: scene->surfaces) {
-        // skip if no emission from surface
-        if (surface->mat->ke == zero3f) {
+    // foreach light sample, taking either each emitter in turn or
+    // path_light_samples emitters picked by power, weighted by their pdf
+    auto nsamples = (scene->path_light_samples > 0 and not scene->emitters.empty()) ?
+        scene->path_light_samples : (int)scene->emitters.size();
+    for(auto sample : range(nsamples)) {
+        // pick emitter
+        auto idx = sample; auto pdf = 1.0f;
+        if(scene->path_light_samples > 0) {
+            if(scene->_light_sampling == path_light_sampling_bvh) idx = sample_emitters_bvh(scene, pos, norm, rng->next_float(), pdf);
+            else idx = scene->emitters_table.sample(rng->next_float(), pdf);
+            if(idx < 0) continue;
+            pdf *= nsamples;
+        }
+        auto& emitter = scene->emitters[idx];
+        
+        // if point light
+        if(emitter.light) {
+            auto light = emitter.light;
+            // compute light response
+            auto cl = light->intensity / (lengthSqr(light->frame.o - pos));
+            // compute light direction
+            auto l = normalize(light->frame.o - pos);
+            // compute the material response (brdf*cos)
+            auto brdfcos = max(dot(norm,l),0.0f) * eval_brdf(kd, ks, n, v, l, norm, mf);
+            // multiply brdf and light
+            auto shade = cl * brdfcos;
+            // check for shadows and accumulate if needed
+            if(shade == zero3f) continue;
+            connect(ray3f::make_segment(pos,light->frame.o), shade / pdf);
             continue;
         }
-        // pick a point on the surface, grabbing normal, area and texcoord
+        
+        // YOUR AREA LIGHT CODE GOES HERE ----------------------
+        // else pick a point on the emitter, grabbing normal, texcoord and the inverse
+        // of the point pdf in area measure (the area, if picked uniformly)
         vec3f S;
         vec3f Nl;
+        vec2f texcoord;
+        float area;
+        Material* mat;
         // check if quad
-        if (surface->isquad){
+        if (emitter.surface and emitter.surface->isquad){
+            auto surface = emitter.surface;
             // generate a 2d random number
             vec2f random_uv = rng->next_vec2f();
             // compute light position, normal, area
             S = transform_point(surface->frame, 2.0f * surface->radius * vec3f(random_uv.x - 0.5f, random_uv.y - 0.5f, 0.0f));
             Nl = transform_normal(surface->frame, vec3f(0.0f, 0.0f, 1.0f));
+            area = 4 * pow(surface->radius, 2);
             // set tex coords as random value got before
-            intersection.texcoord = random_uv;
+            texcoord = random_uv;
+            mat = surface->mat;
+        }
+        // else if sphere, pick a direction in the cone it subtends, uniformly in solid angle
+        else if (emitter.surface) {
+            auto surface = emitter.surface;
+            auto c = surface->frame.o;
+            auto r = surface->radius;
+            auto dist2 = lengthSqr(c - pos);
+            // points inside the sphere are not lit by it
+            if(dist2 <= r*r) continue;
+            auto random_uv = rng->next_vec2f();
+            auto cos_max = sqrt(max(0.0f, 1 - r*r/dist2));
+            auto pdf_w = 1 / (2*pif*(1-cos_max));
+            auto cos_theta = 1 - random_uv.y*(1-cos_max);
+            auto sin_theta = sqrt(max(0.0f, 1 - cos_theta*cos_theta));
+            auto phi = 2*pif*random_uv.x;
+            auto l = transform_direction(frame_from_z(normalize(c - pos)), vec3f(sin_theta*cos(phi), sin_theta*sin(phi), cos_theta));
+            // intersect the sphere along the direction, clamping for grazing directions
+            auto tc = dot(c - pos, l);
+            auto t = tc - sqrt(max(0.0f, r*r - (dist2 - tc*tc)));
+            // points touching the sphere find it closer than shadow rays can reach,
+            // possibly at no distance and with no direction to it
+            if(t <= ray3f_epsilon) continue;
+            S = pos + l * t;
+            Nl = normalize(S - c);
+            // convert the pdf to area measure
+            auto cos_l = -dot(Nl, l);
+            if(cos_l <= 0) continue;
+            area = t*t / (cos_l * pdf_w);
+            auto n = transform_vector_inverse(surface->frame, Nl);
+            texcoord = {(pif+(float)atan2(n.y, n.x))/(2*pif),(float)acos(clamp(n.z,-1.0f,1.0f))/pif};
+            mat = surface->mat;
+        }
+        // else pick a mesh triangle by area, then a point uniformly in it
+        else {
+            auto instance = emitter.mesh;
+            auto mesh = mesh_shape(instance);
+            auto tpdf = 0.0f;
+            auto tid = emitter.triangles.sample(rng->next_float(), tpdf);
+            auto triangle = mesh->triangle[tid];
+            auto random_uv = rng->next_vec2f();
+            auto su = sqrt(random_uv.x);
+            auto u = 1 - su, v = random_uv.y * su;
+            auto v0 = mesh->pos[triangle.x], v1 = mesh->pos[triangle.y], v2 = mesh->pos[triangle.z];
+            S = transform_point(instance->frame, v0*u + v1*v + v2*(1-u-v));
+            Nl = mesh_triangle_normal(instance, tid);
+            area = emitter.area;
+            if(mesh->texcoord.empty()) texcoord = zero2f;
+            else texcoord = mesh->texcoord[triangle.x]*u + mesh->texcoord[triangle.y]*v + mesh->texcoord[triangle.z]*(1-u-v);
+            mat = instance->mat;
         }
-        // else
-            // generate a 2d random number
-            // compute light position, normal, area
-            // set tex coords as random value got before
         
         // get light emission from material and texture
-        vec3f kel = lookup_scaled_texture(surface->mat->ke, surface->mat->ke_txt, intersection.texcoord);
+        vec3f kel = lookup_scaled_texture(mat->ke, mat->ke_txt, texcoord);
         // compute light direction
         vec3f l = normalize(S - pos);
         // compute light response
-        vec3f Cl = kel * 4 * pow(surface->radius, 2) * max(0.0f, -dot(Nl, l)) / lengthSqr(S - pos);
+        vec3f Cl = kel * area * max(0.0f, -dot(Nl, l)) / lengthSqr(S - pos);
         // compute the material response (brdf*cos)
         vec3f mat_resp = max(dot(norm, l), 0.0f) * eval_brdf(kd, ks, n, v, l, norm, mf);
         // multiply brdf and light
@@ -205,127 +595,650 @@ vec3f pathtrace_ray(Scene* scene, ray3f ray, Rng* rng, int depth) {
         if (shade == zero3f) {
             continue;
         }
-        // if shadows are enabled
-        if (scene->path_shadows) {
-            // perform a shadow check and accumulate
-            if (!intersect_shadow(scene, ray3f::make_segment(pos, S))){
-                c += shade;
-            }
-            // else
+        // weight against the brdf sample, comparing pdfs in solid angle
+        if(scene->_mis != path_mis_none) {
+            auto pdf_l = pdf * lengthSqr(S - pos) / (area * -dot(Nl, l));
+            shade *= pathtrace_mis_weight(scene, pdf_l, sample_brdf_pdf(kd, ks, n, v, l, norm));
         }
-        // else just accumulate
-        else {
-            c += shade;
+        connect(ray3f::make_segment(pos, S), shade / pdf);
+    }
+    // sample the brdf for area lights, weighting against the light samples
+    if(scene->_mis != path_mis_none and not scene->emitters.empty()) {
+        auto brdf_sample = sample_brdf(kd, ks, n, v, norm, rng->next_vec2f(), rng->next_float());
+        auto l = brdf_sample.first;
+        if(brdf_sample.second > 0 and dot(norm, l) > 0) {
+            auto hit = intersect(scene, ray3f(pos, l));
+            // quads and meshes emit on the front side only
+            auto sphere = hit.hit and hit.emitter >= 0 and scene->emitters[hit.emitter].surface and
+                          not scene->emitters[hit.emitter].surface->isquad;
+            if(hit.hit and hit.emitter >= 0 and (sphere or dot(emitter_normal(scene, hit), l) < 0)) {
+                auto pdf_l = sample_emitter_pdf(scene, pos, norm, hit.emitter) *
+                             sample_emitter_point_pdf(scene, pos, l, hit);
+                auto kel = lookup_scaled_texture(hit.mat->ke, hit.mat->ke_txt, hit.texcoord);
+                auto shade = kel * dot(norm, l) * eval_brdf(kd, ks, n, v, l, norm, mf) / brdf_sample.second;
+                if(not (shade == zero3f)) {
+                    shade *= pathtrace_mis_weight(scene, brdf_sample.second, pdf_l);
+                    connect(ray3f::make_segment(pos, hit.pos), shade);
+                }
+            }
         }
     }
     // YOUR ENVIRONMENT LIGHT CODE GOES HERE ----------------------
-    // sample the brdf for environment illumination if the environment is there
-    if (scene->background_txt!=nullptr) {
+    // sample the environment map by its distribution, weighting against the brdf sample
+    if (scene->background_txt!=nullptr and scene->path_env_sampling) {
+        auto env_sample = sample_env(scene, rng->next_vec2f());
+        auto l = env_sample.first;
+        if(env_sample.second > 0 and dot(norm, l) > 0) {
+            auto shade = dot(norm, l) * eval_brdf(kd, ks, n, v, l, norm, mf) *
+                         eval_env(scene->background, scene->background_txt, l) / env_sample.second;
+            if(scene->_mis != path_mis_none) shade *= pathtrace_mis_weight(scene, env_sample.second, sample_brdf_pdf(kd, ks, n, v, l, norm));
+            if(not (shade == zero3f)) connect(ray3f(pos, l), shade);
+        }
+    }
+    // sample the brdf for environment illumination if the environment is there,
+    // unless it is sampled by the environment map alone
+    if (scene->background_txt!=nullptr and (not scene->path_env_sampling or scene->_mis != path_mis_none)) {
         // pick direction and pdf
         vec2f random_dir = rng->next_vec2f();
         pair<vec3f,float> pdf = sample_brdf(kd, ks, n, v, norm, random_dir, rng->next_float());
+        if(pdf.second <= 0) return;
         // compute the material response (brdf*cos)
         vec3f mat_resp = max(0.0f, dot(norm, pdf.first)) * eval_brdf(kd, ks, n, v, pdf.first, norm, mf);
         // accumulate recersively scaled by brdf*cos/pdf
         vec3f cl = eval_env(scene->background, scene->background_txt, pdf.first) / pdf.second;
         vec3f shade = mat_resp * cl;
-        // if shadows are enabled
-        if (scene->path_shadows){
-            // perform a shadow check and accumulate
-            if (!intersect_shadow(scene, ray3f(pos, pdf.first))){
-                c += shade;
-            }
-            // else
-        }
+        if(scene->path_env_sampling) shade *= pathtrace_mis_weight(scene, pdf.second, sample_env_pdf(scene, pdf.first));
+        connect(ray3f(pos, pdf.first), shade);
+    }
+}
+
+// compute the direct illumination from point, area and environment lights at a shading point
+vec3f pathtrace_direct(Scene* scene, const ShadePoint& sp, Rng* rng) {
+    auto c = zero3f;
+    pathtrace_direct(scene, sp, rng, [scene,&c](const ray3f& shadow_ray, const vec3f& shade){
+        // if shadows are enabled, perform a shadow check and accumulate
+        if(scene->path_shadows) { if(not intersect_shadow(scene, shadow_ray)) c += shade; }
         // else just accumulate
-        else{
-            c += shade;
-        }
+        else c += shade;
+    });
+    return c;
+}
+
+// compute the color corresponing to a ray by pathtrace, given its scene intersection
+vec3f pathtrace_ray(Scene* scene, ray3f ray, const intersection3f& intersection, Rng* rng, int depth, const RayCone& cone) {
+    // if not hit, return background (looking up the texture by converting the ray direction to latlong around y)
+    if(not intersection.hit) {
+        // YOUR CODE GOES HERE ----------------------
+        return eval_env(scene->background, scene->background_txt, ray.d);
+    }
+    
+    // setup the shading point
+    auto sp = make_shadepoint(intersection, ray, cone);
+    
+    // accumulate color starting with ambient
+    auto c = scene->ambient * sp.kd;
+    
+    // add emission if on the first bounce
+    // YOUR CODE GOES HERE ----------------------
+    if (depth == 0) {
+        c += sp.ke;
     }
+    
+    // add direct illumination
+    c += pathtrace_direct(scene, sp, rng);
+    
     // YOUR INDIRECT ILLUMINATION CODE GOES HERE ----------------------
     // sample the brdf for indirect illumination
     if (depth < scene->path_max_depth){
         // pick direction and pdf
         vec2f random_dir = rng->next_vec2f();
-        pair<vec3f,float> pdf = sample_brdf(kd, ks, n, v, norm, random_dir, rng->next_float());
+        pair<vec3f,float> pdf = sample_brdf(sp.kd, sp.ks, sp.n, sp.v, sp.norm, random_dir, rng->next_float());
+        if(pdf.second <= 0) return c;
         // compute the material response (brdf*cos)
-        vec3f mat_resp = max(0.0f, dot(norm, pdf.first)) * eval_brdf(kd, ks, n, v, pdf.first, norm, mf);
+        vec3f mat_resp = max(0.0f, dot(sp.norm, pdf.first)) * eval_brdf(sp.kd, sp.ks, sp.n, sp.v, pdf.first, sp.norm, sp.mf);
         // accumulate recersively scaled by brdf*cos/pdf
-        ray3f new_ray = ray3f(pos, pdf.first);
-        c += pathtrace_ray(scene, new_ray, rng, depth + 1) * (mat_resp / pdf.second);
+        ray3f new_ray = ray3f(sp.pos, pdf.first);
+        c += pathtrace_ray(scene, new_ray, intersect(scene,new_ray), rng, depth + 1, make_bounce_cone(sp, pdf.second)) * (mat_resp / pdf.second);
+    }
+    // return the accumulated color
+    return c;
+}
+
+// compute the color corresponing to a ray by pathtrace, following the path
+// iteratively while tracking its throughput; paths longer than path_rr_min_depth
+// are terminated by russian roulette if enabled; the camera ray intersection is given
+vec3f pathtrace_ray_iterative(Scene* scene, ray3f ray, intersection3f intersection, Rng* rng) {
+    auto c = zero3f;
+    auto weight = one3f;
+    auto cone = make_camera_cone(scene);
+    for(auto depth = 0; ; depth ++) {
+        // get scene intersection
+        if(depth > 0) intersection = intersect(scene,ray);
+        
+        // if not hit, add background and stop
+        if(not intersection.hit) {
+            c += weight * eval_env(scene->background, scene->background_txt, ray.d);
+            break;
+        }
+        
+        // setup the shading point
+        auto sp = make_shadepoint(intersection, ray, cone);
+        
+        // accumulate ambient, emission on the first bounce and direct illumination
+        auto cd = scene->ambient * sp.kd;
+        if(depth == 0) cd += sp.ke;
+        cd += pathtrace_direct(scene, sp, rng);
+        c += weight * cd;
+        
+        // stop at max depth
+        if(depth >= scene->path_max_depth) break;
+        
+        // sample the brdf for indirect illumination
+        auto random_dir = rng->next_vec2f();
+        auto pdf = sample_brdf(sp.kd, sp.ks, sp.n, sp.v, sp.norm, random_dir, rng->next_float());
+        if(pdf.second <= 0) break;
+        auto mat_resp = max(0.0f, dot(sp.norm, pdf.first)) * eval_brdf(sp.kd, sp.ks, sp.n, sp.v, pdf.first, sp.norm, sp.mf);
+        weight *= mat_resp / pdf.second;
+        if(weight == zero3f) break;
+        
+        // russian roulette, with survival probability proportional to the throughput
+        if(scene->path_russian_roulette and depth+1 >= scene->path_rr_min_depth) {
+            auto q = min(0.95f, max(weight.x, max(weight.y, weight.z)));
+            if(rng->next_float() >= q) break;
+            weight /= q;
+        }
+        
+        // continue the path
+        ray = ray3f(sp.pos, pdf.first);
+        cone = make_bounce_cone(sp, pdf.second);
     }
     // return the accumulated color
     return c;
 }
 
-// pathtrace an image
-void pathtrace(Scene* scene, image3f* image, RngImage* rngs, int offset_row, int skip_row, bool verbose) {
-    if(verbose) message("\n  rendering started        ");
+// compute the color corresponing to a camera ray, given its scene intersection, with the scene integrator
+vec3f pathtrace_ray(Scene* scene, ray3f ray, const intersection3f& intersection, Rng* rng) {
+    if(scene->_integrator == path_integrator_iterative) return pathtrace_ray_iterative(scene, ray, intersection, rng);
+    else return pathtrace_ray(scene, ray, intersection, rng, 0, make_camera_cone(scene));
+}
+
+// image region rendered as a single unit of work
+struct ImageTile {
+    int x = 0, y = 0;   // tile origin
+    int w = 0, h = 0;   // tile size
+};
+
+// work-stealing tile scheduler: every thread owns a deque of tiles, pops work
+// from the front of its own deque and, once empty, steals from the back of the others
+struct TileScheduler {
+    vector<std::deque<ImageTile>>   queues; // per-thread tile queues
+    vector<std::mutex>              locks;  // per-thread queue locks
+    std::atomic<int>                done;   // number of tiles completed
+    int                             ntiles; // total number of tiles
+    
+    // split the image in tiles and assign contiguous runs of them to each thread
+    TileScheduler(int width, int height, int tile_size, int nthreads) :
+        queues(nthreads), locks(nthreads), done(0), ntiles(0) {
+        tile_size = max(1, tile_size);
+        auto tiles = vector<ImageTile>();
+        for(auto y = 0; y < height; y += tile_size) {
+            for(auto x = 0; x < width; x += tile_size) {
+                auto tile = ImageTile();
+                tile.x = x; tile.y = y;
+                tile.w = min(tile_size, width-x); tile.h = min(tile_size, height-y);
+                tiles.push_back(tile);
+            }
+        }
+        ntiles = tiles.size();
+        for(auto i : range(ntiles)) queues[i * nthreads / ntiles].push_back(tiles[i]);
+    }
+    
+    // grab the next tile for thread tid, stealing from other threads if needed
+    bool next(int tid, ImageTile& tile) {
+        auto nthreads = (int)queues.size();
+        for(auto k : range(nthreads)) {
+            auto qid = (tid + k) % nthreads;
+            std::lock_guard<std::mutex> lock(locks[qid]);
+            auto& queue = queues[qid];
+            if(queue.empty()) continue;
+            if(k == 0) { tile = queue.front(); queue.pop_front(); }
+            else { tile = queue.back(); queue.pop_back(); }
+            return true;
+        }
+        return false;
+    }
+};
+
+// rendering state shared by all threads
+struct RenderState {
+    image3f             accum;          // accumulated radiance for each pixel
+    vector<float>       accum_lum2;     // accumulated squared luminance for each pixel
+    vector<int>         samples;        // samples accumulated in each pixel
+    vector<int>         strata;         // order in which the pixel strata are sampled
+    std::atomic<long>   pass_samples;   // samples taken in the current pass
+    
+    // allocate buffers and pick the strata order for the scene
+    RenderState(Scene* scene) :
+        accum(scene->image_width, scene->image_height),
+        accum_lum2(scene->image_width*scene->image_height, 0),
+        samples(scene->image_width*scene->image_height, 0),
+        strata(scene->image_samples*scene->image_samples),
+        pass_samples(0) {
+        // shuffle the strata so that partial renders still cover the whole pixel
+        for(auto i : range(strata.size())) strata[i] = i;
+        std::shuffle(strata.begin(), strata.end(), std::minstd_rand(0));
+    }
+    
+    // samples accumulated in a pixel
+    int& samples_at(int i, int j) { return samples[j*accum.width()+i]; }
+    
+    // average of the samples accumulated so far
+    image3f resolve() const {
+        auto image = image3f(accum.width(), accum.height());
+        for(auto idx : range(samples.size())) {
+            if(samples[idx]) image.data()[idx] = accum.data()[idx] / samples[idx];
+        }
+        return image;
+    }
+};
+
+// maximum number of samples taken in each pixel
+int pathtrace_max_samples(Scene* scene) {
+    auto samples = scene->image_samples*scene->image_samples;
+    if(scene->image_adaptive_threshold <= 0 or scene->image_adaptive_max_samples <= 0) return samples;
+    return scene->image_adaptive_max_samples;
+}
+
+// check whether a pixel needs no more samples: either the maximum was reached, or
+// the standard error of the luminance mean is below the adaptive threshold
+bool pathtrace_converged(Scene* scene, RenderState* state, int i, int j) {
+    auto n = state->samples_at(i, j);
+    if(n >= pathtrace_max_samples(scene)) return true;
+    if(scene->image_adaptive_threshold <= 0) return false;
+    if(n < max(2, scene->image_adaptive_min_samples)) return false;
+    auto lum = mean(state->accum.at(i, j)) / n;
+    auto var = max(0.0f, state->accum_lum2[j*state->accum.width()+i] / n - lum*lum) * n / (n-1);
+    return sqrt(var / n) <= scene->image_adaptive_threshold * (lum + 0.01f);
+}
+
+// random number generator for sample s of pixel (i,j), keyed by the scene seed
+// and drawing from the scene sampler
+Rng pathtrace_rng(Scene* scene, int i, int j, int s) {
+    return Rng(scene->image_seed, j*scene->image_width+i, s, scene->_sampler);
+}
+
+// compute the camera ray for sample s of pixel (i,j), jittered in the sample stratum
+// (the low-discrepancy samplers stratify the whole pixel by themselves)
+ray3f pathtrace_camera_ray(Scene* scene, RenderState* state, int i, int j, int s, Rng* rng) {
+    // pick the pixel stratum for the sample
+    auto stratum = state->strata[s % state->strata.size()];
+    auto nstrata = (rng->sampler == rng_sampler_random) ? scene->image_samples : 1;
+    auto ii = stratum % scene->image_samples % nstrata;
+    auto jj = stratum / scene->image_samples % nstrata;
+    // compute ray-camera parameters (u,v) for the pixel and the sample
+    auto ruv = rng->next_vec2f();
+    auto u = (i + (ii + ruv.x)/nstrata) /
+        scene->image_width;
+    auto v = (j + (jj + ruv.y)/nstrata) /
+        scene->image_height;
+    // compute camera ray
+    return transform_ray(scene->camera->frame,
+        ray3f(zero3f,normalize(vec3f((u-0.5f)*scene->camera->width,
+                                     (v-0.5f)*scene->camera->height,-1))));
+}
+
+#define pathtrace_wavefront_size 16384
+
+// path states in flight in the wavefront engine, as structure of arrays
+struct PathQueue {
+    vector<ray3f>   ray;        // ray to extend the path with
+    vector<RayCone> cone;       // ray cone, for texture filtering
+    vector<vec3f>   weight;     // path throughput
+    vector<int>     sample;     // sample the path contributes to
+    
+    // number of paths
+    int size() const { return ray.size(); }
+    // remove all paths
+    void clear() { ray.clear(); cone.clear(); weight.clear(); sample.clear(); }
+    // add a path
+    void push(const ray3f& r, const RayCone& c, const vec3f& w, int s) {
+        ray.push_back(r); cone.push_back(c); weight.push_back(w); sample.push_back(s);
+    }
+};
+
+// shadow rays in flight in the wavefront engine, as structure of arrays
+struct ShadowQueue {
+    vector<ray3f>   ray;        // shadow ray
+    vector<vec3f>   shade;      // contribution if the light is visible
+    vector<int>     sample;     // sample the contribution is added to
+    
+    // number of shadow rays
+    int size() const { return ray.size(); }
+    // remove all shadow rays
+    void clear() { ray.clear(); shade.clear(); sample.clear(); }
+    // add a shadow ray
+    void push(const ray3f& r, const vec3f& c, int s) { ray.push_back(r); shade.push_back(c); sample.push_back(s); }
+};
+
+// pathtrace a batch of samples in wavefront order: each stage (extend, shade
+// grouped by material, connect) runs over all the paths in flight before the next
+void pathtrace_wavefront(Scene* scene, RenderState* state, const vector<vec2i>& pixels, const vector<int>& samples,
+                         const map<Material*,int>& materials) {
+    auto nsamples = (int)pixels.size();
+    auto russian_roulette = scene->_integrator == path_integrator_iterative and scene->path_russian_roulette;
+    auto radiance = vector<vec3f>(nsamples, zero3f);
+    auto rngs = vector<Rng>(nsamples);
+    auto paths = PathQueue(), next = PathQueue();
+    auto shadows = ShadowQueue();
+    auto hits = vector<intersection3f>();
+    auto order = vector<int>();
+    auto offsets = vector<int>();
+    
+    // generate camera rays
+    auto camera_cone = make_camera_cone(scene);
+    for(auto k : range(nsamples)) {
+        rngs[k] = pathtrace_rng(scene, pixels[k].x, pixels[k].y, samples[k]);
+        paths.push(pathtrace_camera_ray(scene, state, pixels[k].x, pixels[k].y, samples[k], &rngs[k]), camera_cone, one3f, k);
+    }
+    
+    for(auto depth = 0; paths.size(); depth ++) {
+        // extend paths by intersecting their rays with the scene, in packets when coherent
+        hits.resize(paths.size());
+        intersect(scene, paths.ray.data(), paths.size(), hits.data());
+        
+        // add background to missed paths and group the others by material
+        offsets.assign(materials.size()+1, 0);
+        for(auto p : range(paths.size())) {
+            if(hits[p].hit) { offsets[materials.at(hits[p].mat)+1] ++; continue; }
+            radiance[paths.sample[p]] += paths.weight[p] * eval_env(scene->background, scene->background_txt, paths.ray[p].d);
+        }
+        for(auto m : range(materials.size())) offsets[m+1] += offsets[m];
+        order.resize(offsets.back());
+        for(auto p : range(paths.size())) if(hits[p].hit) order[offsets[materials.at(hits[p].mat)] ++] = p;
+        
+        // shade hits, queueing shadow rays for direct lighting and new rays for indirect
+        next.clear(); shadows.clear();
+        for(auto p : order) {
+            auto sample = paths.sample[p];
+            auto weight = paths.weight[p];
+            auto rng = &rngs[sample];
+            auto sp = make_shadepoint(hits[p], paths.ray[p], paths.cone[p]);
+            
+            // accumulate ambient, emission on the first bounce and direct illumination
+            auto cd = scene->ambient * sp.kd;
+            if(depth == 0) cd += sp.ke;
+            radiance[sample] += weight * cd;
+            pathtrace_direct(scene, sp, rng, [&](const ray3f& shadow_ray, const vec3f& shade){
+                if(scene->path_shadows) shadows.push(shadow_ray, weight * shade, sample);
+                else radiance[sample] += weight * shade;
+            });
+            
+            // stop at max depth
+            if(depth >= scene->path_max_depth) continue;
+            
+            // sample the brdf for indirect illumination
+            auto random_dir = rng->next_vec2f();
+            auto pdf = sample_brdf(sp.kd, sp.ks, sp.n, sp.v, sp.norm, random_dir, rng->next_float());
+            if(pdf.second <= 0) continue;
+            auto mat_resp = max(0.0f, dot(sp.norm, pdf.first)) * eval_brdf(sp.kd, sp.ks, sp.n, sp.v, pdf.first, sp.norm, sp.mf);
+            weight *= mat_resp / pdf.second;
+            if(weight == zero3f) continue;
+            
+            // russian roulette, as in the iterative integrator
+            if(russian_roulette and depth+1 >= scene->path_rr_min_depth) {
+                auto q = min(0.95f, max(weight.x, max(weight.y, weight.z)));
+                if(rng->next_float() >= q) continue;
+                weight /= q;
+            }
+            next.push(ray3f(sp.pos, pdf.first), make_bounce_cone(sp, pdf.second), weight, sample);
+        }
+        
+        // connect shading points to lights with all shadow rays at once, in packets when coherent
+        for(auto start = 0; start < shadows.size(); start += ray3f_packet_size) {
+            auto n = min(ray3f_packet_size, shadows.size() - start);
+            bool occluded[ray3f_packet_size];
+            intersect_shadow(scene, shadows.ray.data() + start, n, occluded);
+            for(auto s : range(start, start + n)) {
+                if(not occluded[s-start]) radiance[shadows.sample[s]] += shadows.shade[s];
+            }
+        }
+        
+        // continue with the new rays
+        std::swap(paths, next);
+    }
+    
+    // accumulate samples in their pixels
+    for(auto k : range(nsamples)) {
+        auto i = pixels[k].x, j = pixels[k].y;
+        state->accum.at(i,j) += radiance[k];
+        state->accum_lum2[j*scene->image_width+i] += mean(radiance[k])*mean(radiance[k]);
+    }
+}
+
+// pathtrace up to nsamples more samples for each unconverged pixel in an image tile
+// with the wavefront engine, in batches of at most pathtrace_wavefront_size samples
+void pathtrace_wavefront(Scene* scene, RenderState* state, const ImageTile& tile, int nsamples) {
+    // number materials, to shade paths grouped by material in a deterministic order
+    auto materials = map<Material*,int>();
+    for(auto surface : scene->surfaces) materials.insert({surface->mat, (int)materials.size()});
+    for(auto mesh : scene->meshes) materials.insert({mesh->mat, (int)materials.size()});
+    
+    // collect the samples to take, flushing a batch whenever full
+    auto pixels = vector<vec2i>();
+    auto samples = vector<int>();
+    auto taken = 0l;
+    for(auto j = tile.y; j < tile.y + tile.h; j ++) {
+        for(auto i = tile.x; i < tile.x + tile.w; i ++) {
+            // skip pixels that are done
+            if(pathtrace_converged(scene, state, i, j)) continue;
+            auto& pixel_samples = state->samples_at(i, j);
+            auto sample_end = min(pixel_samples + nsamples, pathtrace_max_samples(scene));
+            for(auto s : range(pixel_samples, sample_end)) {
+                pixels.push_back({i,j});
+                samples.push_back(s);
+                if(pixels.size() < pathtrace_wavefront_size) continue;
+                pathtrace_wavefront(scene, state, pixels, samples, materials);
+                pixels.clear(); samples.clear();
+            }
+            taken += sample_end - pixel_samples;
+            pixel_samples = sample_end;
+        }
+    }
+    if(not pixels.empty()) pathtrace_wavefront(scene, state, pixels, samples, materials);
+    state->pass_samples += taken;
+}
+
+// pathtrace up to nsamples more samples for each unconverged pixel in an image tile
+void pathtrace(Scene* scene, RenderState* state, const ImageTile& tile, int nsamples) {
+    auto taken = 0l;
     // foreach pixel
-    for(auto j = offset_row; j < scene->image_height; j += skip_row ) {
-        if(verbose) message("\r  rendering %03d/%03d        ", j, scene->image_height);
-        for(auto i = 0; i < scene->image_width; i ++) {
-            // init accumulated color
-            image->at(i,j) = zero3f;
-            // grab proper random number generator
-            auto rng = &rngs->at(i, j);
+    for(auto j = tile.y; j < tile.y + tile.h; j ++) {
+        for(auto i = tile.x; i < tile.x + tile.w; i ++) {
+            // skip pixels that are done
+            if(pathtrace_converged(scene, state, i, j)) continue;
             // foreach sample
-            for(auto jj : range(scene->image_samples)) {
-                for(auto ii : range(scene->image_samples)) {
-                    // compute ray-camera parameters (u,v) for the pixel and the sample
-                    auto u = (i + (ii + rng->next_float())/scene->image_samples) /
-                        scene->image_width;
-                    auto v = (j + (jj + rng->next_float())/scene->image_samples) /
-                        scene->image_height;
-                    // compute camera ray
-                    auto ray = transform_ray(scene->camera->frame,
-                        ray3f(zero3f,normalize(vec3f((u-0.5f)*scene->camera->width,
-                                                     (v-0.5f)*scene->camera->height,-1))));
-                    // set pixel to the color raytraced with the ray
-                    image->at(i,j) += pathtrace_ray(scene,ray,rng,0);
+            auto& samples = state->samples_at(i, j);
+            auto sample_end = min(samples + nsamples, pathtrace_max_samples(scene));
+            for(auto s = samples; s < sample_end; s += ray3f_packet_size) {
+                // compute camera rays for a packet of samples, intersected together
+                auto n = min(ray3f_packet_size, sample_end - s);
+                ray3f rays[ray3f_packet_size];
+                intersection3f intersections[ray3f_packet_size];
+                Rng rngs[ray3f_packet_size];
+                for(auto k : range(n)) {
+                    rngs[k] = pathtrace_rng(scene, i, j, s+k);
+                    rays[k] = pathtrace_camera_ray(scene, state, i, j, s+k, &rngs[k]);
+                }
+                intersect(scene, rays, n, intersections);
+                // accumulate the color raytraced with each ray
+                for(auto k : range(n)) {
+                    auto c = pathtrace_ray(scene,rays[k],intersections[k],&rngs[k]);
+                    state->accum.at(i,j) += c;
+                    state->accum_lum2[j*scene->image_width+i] += mean(c)*mean(c);
                 }
             }
-            // scale by the number of samples
-            image->at(i,j) /= (scene->image_samples*scene->image_samples);
+            taken += sample_end - samples;
+            samples = sample_end;
         }
     }
-    if(verbose) message("\r  rendering done        \n");
-    
+    state->pass_samples += taken;
 }
 
-// pathtrace an image with multithreading if necessary
-image3f pathtrace(Scene* scene, bool multithread) {
-    // allocate an image of the proper size
-    auto image = image3f(scene->image_width, scene->image_height);
-    
-    // create a random number generator for each pixel
-    auto rngs = RngImage(scene->image_width, scene->image_height);
+// pathtrace all tiles handed out by the scheduler
+void pathtrace(Scene* scene, RenderState* state, TileScheduler* scheduler, int tid, int nsamples, bool verbose) {
+    auto tile = ImageTile();
+    while(scheduler->next(tid, tile)) {
+        if(scene->path_wavefront) pathtrace_wavefront(scene, state, tile, nsamples);
+        else pathtrace(scene, state, tile, nsamples);
+        auto done = ++scheduler->done;
+        if(verbose) message("\r  rendering %03d/%03d        ", done, scheduler->ntiles);
+    }
+}
+
+// pathtrace a pass of up to nsamples samples per pixel over the whole image
+// with multithreading if necessary; returns the number of samples taken
+long pathtrace(Scene* scene, RenderState* state, int nsamples, bool multithread, bool verbose) {
+    // split the image in tiles, assigned to each thread
+    auto nthreads = (multithread) ? max(1, (int)thread::hardware_concurrency()) : 1;
+    TileScheduler scheduler(scene->image_width, scene->image_height, scene->image_tile_size, nthreads);
+    state->pass_samples = 0;
 
     // if multitreaded
     if(multithread) {
         // get pointers
-        auto image_ptr = &image;
-        auto rngs_ptr = &rngs;
-        // allocate threads and pathtrace in blocks
+        auto scheduler_ptr = &scheduler;
+        // allocate threads and pathtrace tiles until none is left
         auto threads = vector<thread>();
-        auto nthreads = thread::hardware_concurrency();
         for(auto tid : range(nthreads)) threads.push_back(thread([=](){
-            return pathtrace(scene,image_ptr,rngs_ptr,tid,nthreads,tid==0);}));
+            return pathtrace(scene,state,scheduler_ptr,tid,nsamples,verbose and tid==0);}));
         for(auto& thread : threads) thread.join();
     } else {
-        // pathtrace all rows
-        pathtrace(scene, &image, &rngs, 0, 1, true);
+        // pathtrace all tiles
+        pathtrace(scene, state, &scheduler, 0, nsamples, verbose);
+    }
+    return state->pass_samples;
+}
+
+// save an image as pfm or png depending on the filename extension
+void save_image(const string& filename, const image3f& image) {
+    if(filename.size() > 4 and filename.substr(filename.size()-4) == ".pfm") write_pfm(filename, image, true);
+    else write_png(filename, image, true);
+}
+
+// pathtrace an image with multithreading if necessary; in progressive or adaptive mode,
+// snapshots are saved to snapshot_filename every image_snapshot_passes passes
+image3f pathtrace(Scene* scene, bool multithread, const string& snapshot_filename) {
+    // collect the lights to sample
+    make_emitters(scene);
+    make_env_distribution(scene);
+    
+    // allocate accumulation buffer and random number generators
+    RenderState state(scene);
+    auto adaptive = scene->image_adaptive_threshold > 0;
+    auto npixels = scene->image_width*scene->image_height;
+    
+    // render all samples of each tile at once
+    if(not scene->image_progressive and not adaptive) {
+        message("\n  rendering started        ");
+        pathtrace(scene, &state, pathtrace_max_samples(scene), multithread, true);
+        message("\r  rendering done        \n");
+        return state.resolve();
     }
     
-    // done
-    return image;
+    // render one pass at a time until all pixels are done or out of time;
+    // adaptive rendering starts with min samples and then refines unconverged pixels
+    message("\n  rendering started        ");
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = 0.0f;
+    auto passes = 0;
+    auto total = 0l;
+    auto nsamples = (adaptive) ? max(1, scene->image_adaptive_min_samples) : 1;
+    while(true) {
+        auto taken = pathtrace(scene, &state, nsamples, multithread, false);
+        if(not taken) break;
+        nsamples = 1;
+        passes ++;
+        total += taken;
+        elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now()-start).count();
+        message("\r  rendering pass %03d: %.1f spp (%.1fs)        ", passes, total/(float)npixels, elapsed);
+        if(scene->image_snapshot_passes > 0 and not snapshot_filename.empty() and
+           passes % scene->image_snapshot_passes == 0) save_image(snapshot_filename, state.resolve());
+        if(scene->image_time_budget > 0 and elapsed >= scene->image_time_budget) break;
+    }
+    message("\r  rendering done: %d passes, %.1f spp in %.1fs        \n", passes, total/(float)npixels, elapsed);
+    return state.resolve();
+}
+
+// count the pixels with a nan or infinite value
+int count_nonfinite(const image3f& image) {
+    auto count = 0;
+    for(auto j : range(image.height())) {
+        for(auto i : range(image.width())) {
+            auto& c = image.at(i,j);
+            if(not (std::isfinite(c.x) and std::isfinite(c.y) and std::isfinite(c.z))) count ++;
+        }
+    }
+    return count;
+}
+
+// skin the meshes to the bone transforms of the current animation time, as in hw4
+void animate_skin(Scene* scene) {
+    for(auto mesh : scene->meshes) {
+        auto skinning = mesh->skinning;
+        if(not skinning or skinning->bone_xforms.empty()) continue;
+        auto& bone_xforms = skinning->bone_xforms[min(scene->animation->time, (int)skinning->bone_xforms.size()-1)];
+        for(auto i : range(mesh->pos.size())) {
+            mesh->pos[i] = zero3f;
+            mesh->norm[i] = zero3f;
+            for(auto j : range(4)) {
+                if(skinning->bone_ids[i][j] < 0) continue;
+                auto& xform = bone_xforms[skinning->bone_ids[i][j]];
+                mesh->pos[i] += skinning->bone_weights[i][j] * transform_point(xform, skinning->rest_pos[i]);
+                mesh->norm[i] += skinning->bone_weights[i][j] * transform_normal(xform, skinning->rest_norm[i]);
+            }
+            mesh->norm[i] = normalize(mesh->norm[i]);
+        }
+    }
+}
+
+// filename of an animation frame, numbering it before the extension
+string frame_filename(const string& filename, int frame) {
+    char suffix[16]; sprintf(suffix, ".%03d", frame);
+    auto ext = filename.rfind('.');
+    if(ext == string::npos) return filename + suffix;
+    return filename.substr(0, ext) + suffix + filename.substr(ext);
+}
+
+// index of an option value in the list of its names (-1 if unknown)
+int option_index(const string& value, const vector<string>& names) {
+    for(auto i : range(names.size())) if(names[i] == value) return i;
+    return -1;
 }
 
 // runs the raytrace over all tests and saves the corresponding images
 int main(int argc, char** argv) {
     auto args = parse_cmdline(argc, argv,
         { "05_pathtrace", "raytrace a scene",
-            {  {"resolution", "r", "image resolution", "int", true, jsonvalue() }  },
+            {  {"resolution", "r", "image resolution", "int", true, jsonvalue() },
+               {"tile_size", "t", "image tile size", "int", true, jsonvalue() },
+               {"samples", "s", "samples per pixel in each direction", "int", true, jsonvalue() },
+               {"seed", "R", "random seed", "int", true, jsonvalue() },
+               {"sampler", "q", "sampler (random, sobol, halton, r2)", "string", true, jsonvalue() },
+               {"progressive", "p", "render one pass at a time", "bool", true, jsonvalue(false) },
+               {"time_budget", "b", "progressive time budget in seconds", "float", true, jsonvalue() },
+               {"snapshot_passes", "S", "passes between progressive snapshots", "int", true, jsonvalue() },
+               {"adaptive_threshold", "a", "adaptive sampling error threshold", "float", true, jsonvalue() },
+               {"min_samples", "m", "adaptive sampling min samples per pixel", "int", true, jsonvalue() },
+               {"max_samples", "M", "adaptive sampling max samples per pixel", "int", true, jsonvalue() },
+               {"integrator", "i", "path integrator (recursive, iterative)", "string", true, jsonvalue() },
+               {"max_depth", "d", "maximum path depth", "int", true, jsonvalue() },
+               {"wavefront", "w", "render with the wavefront engine", "bool", true, jsonvalue(false) },
+               {"light_samples", "l", "lights sampled at each shading point (0 for all lights)", "int", true, jsonvalue() },
+               {"light_sampling", "L", "how lights are sampled (power, bvh)", "string", true, jsonvalue() },
+               {"mis", "x", "heuristic combining light and brdf samples (none, balance, power)", "string", true, jsonvalue() },
+               {"env_sampling", "e", "importance sample the environment map", "bool", true, jsonvalue(false) },
+               {"bvh_cache", "c", "directory caching mesh bvhs across runs", "string", true, jsonvalue() },
+               {"animate", "A", "render each frame of the skinning animation", "bool", true, jsonvalue(false) }  },
             {  {"scene_filename", "", "scene filename", "string", false, jsonvalue("scene.json")},
                {"image_filename", "", "image filename", "string", true, jsonvalue("")}  }
         });
@@ -338,10 +1251,85 @@ int main(int argc, char** argv) {
         scene->image_height = args.object_element("resolution").as_int();
         scene->image_width = scene->camera->width * scene->image_height / scene->camera->height;
     }
-    accelerate(scene);
-    message("rendering %s ... ", scene_filename.c_str());
-    auto image = pathtrace(scene,true);
-    write_png(image_filename, image, true);
+    if(not args.object_element("tile_size").is_null()) {
+        scene->image_tile_size = args.object_element("tile_size").as_int();
+    }
+    if(not args.object_element("samples").is_null()) {
+        scene->image_samples = args.object_element("samples").as_int();
+    }
+    if(not args.object_element("seed").is_null()) {
+        scene->image_seed = args.object_element("seed").as_int();
+    }
+    if(not args.object_element("sampler").is_null()) {
+        scene->image_sampler = args.object_element("sampler").as_string();
+    }
+    if(args.object_element("progressive").as_bool()) {
+        scene->image_progressive = true;
+    }
+    if(not args.object_element("time_budget").is_null()) {
+        scene->image_time_budget = args.object_element("time_budget").as_float();
+    }
+    if(not args.object_element("snapshot_passes").is_null()) {
+        scene->image_snapshot_passes = args.object_element("snapshot_passes").as_int();
+    }
+    if(not args.object_element("adaptive_threshold").is_null()) {
+        scene->image_adaptive_threshold = args.object_element("adaptive_threshold").as_float();
+    }
+    if(not args.object_element("min_samples").is_null()) {
+        scene->image_adaptive_min_samples = args.object_element("min_samples").as_int();
+    }
+    if(not args.object_element("max_samples").is_null()) {
+        scene->image_adaptive_max_samples = args.object_element("max_samples").as_int();
+    }
+    if(not args.object_element("integrator").is_null()) {
+        scene->path_integrator = args.object_element("integrator").as_string();
+    }
+    if(not args.object_element("max_depth").is_null()) {
+        scene->path_max_depth = args.object_element("max_depth").as_int();
+    }
+    if(args.object_element("wavefront").as_bool()) {
+        scene->path_wavefront = true;
+    }
+    if(not args.object_element("light_samples").is_null()) {
+        scene->path_light_samples = args.object_element("light_samples").as_int();
+    }
+    if(not args.object_element("light_sampling").is_null()) {
+        scene->path_light_sampling = args.object_element("light_sampling").as_string();
+    }
+    if(not args.object_element("mis").is_null()) {
+        scene->path_mis = args.object_element("mis").as_string();
+    }
+    if(args.object_element("env_sampling").as_bool()) {
+        scene->path_env_sampling = true;
+    }
+    if(not args.object_element("bvh_cache").is_null()) {
+        scene->bvh_cache = args.object_element("bvh_cache").as_string();
+    }
+    // resolve the options once, so that rendering does not compare strings
+    scene->_sampler = option_index(scene->image_sampler, {"random", "sobol", "halton", "r2"});
+    error_if_not(scene->_sampler >= 0, "unknown sampler %s", scene->image_sampler.c_str());
+    scene->_integrator = option_index(scene->path_integrator, {"recursive", "iterative"});
+    error_if_not(scene->_integrator >= 0, "unknown integrator %s", scene->path_integrator.c_str());
+    scene->_light_sampling = option_index(scene->path_light_sampling, {"power", "bvh"});
+    error_if_not(scene->_light_sampling >= 0, "unknown light sampling %s", scene->path_light_sampling.c_str());
+    scene->_mis = option_index(scene->path_mis, {"none", "balance", "power"});
+    error_if_not(scene->_mis >= 0, "unknown mis heuristic %s", scene->path_mis.c_str());
+    // render a still, or each animation frame, refitting the accelerators to the skinned meshes
+    auto animate = args.object_element("animate").as_bool();
+    auto frames = (animate) ? max(1, scene->animation->length) : 1;
+    for(auto frame : range(frames)) {
+        auto filename = (animate) ? frame_filename(image_filename, frame) : image_filename;
+        if(animate) { scene->animation->time = frame; animate_skin(scene); }
+        if(frame == 0) accelerate(scene);
+        else refit(scene);
+        message("rendering %s ... ", scene_filename.c_str());
+        auto image = pathtrace(scene,true,filename);
+        save_image(filename, image);
+        // check that no pixel is nan or infinite, as left by samples with zero pdfs
+        auto nonfinite = count_nonfinite(image);
+        error_if_not(nonfinite == 0, "%d pixels are not finite\n", nonfinite);
+        if(frame+1 < frames) message("done\n");
+    }
     delete scene;
     message("done\n");
 }
@@ -1,8 +1,8 @@
 #include "scene.h"
 #include "tesselation.h"
 
-vector<image3f*> get_textures(Scene* scene) {
-    auto textures = set<image3f*>();
+vector<texture3f*> get_textures(Scene* scene) {
+    auto textures = set<texture3f*>();
     for(auto mesh : scene->meshes) {
         if(mesh->mat->ke_txt) textures.insert(mesh->mat->ke_txt);
         if(mesh->mat->kd_txt) textures.insert(mesh->mat->kd_txt);
@@ -16,7 +16,7 @@ vector<image3f*> get_textures(Scene* scene) {
         if(surface->mat->norm_txt) textures.insert(surface->mat->norm_txt);
     }
     if(scene->background_txt) textures.insert(scene->background_txt);
-    return vector<image3f*>(textures.begin(),textures.end());
+    return vector<texture3f*>(textures.begin(),textures.end());
 }
 
 Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist) {
@@ -57,6 +57,7 @@ void json_set_values(const jsonvalue& json, int* value, int n) {
 }
 
 void json_set_value(const jsonvalue& json, bool& value) { value = json.as_bool(); }
+void json_set_value(const jsonvalue& json, string& value) { value = json.as_string(); }
 void json_set_value(const jsonvalue& json, int& value) { value = json.as_int(); }
 void json_set_value(const jsonvalue& json, float& value) { value = json.as_double(); }
 void json_set_value(const jsonvalue& json, vec2f& value) { json_set_values(json, &value.x, 2); }
@@ -128,7 +129,7 @@ Camera* json_parse_lookatcamera(const jsonvalue& json) {
 }
 
 vector<string>          json_texture_paths;
-map<string,image3f*>    json_texture_cache;
+map<string,texture3f*>  json_texture_cache;
 
 void json_texture_path_push(string filename) {
     auto pos = filename.rfind("/");
@@ -137,7 +138,7 @@ void json_texture_path_push(string filename) {
 }
 void json_texture_path_pop() { json_texture_paths.pop_back(); }
 
-void json_parse_opttexture(jsonvalue json, image3f*& txt, string name) {
+void json_parse_opttexture(jsonvalue json, texture3f*& txt, string name) {
     if(not json.object_contains(name)) return;
     auto filename = json.object_element(name).as_string();
     if(filename.empty()) { txt = nullptr; return; }
@@ -148,10 +149,10 @@ void json_parse_opttexture(jsonvalue json, image3f*& txt, string name) {
         if(ext == "pfm") {
             auto image = read_pnm("models/pisa_latlong.pfm", true);
             image = image.gamma(1/2.2);
-            json_texture_cache[fullname] = new image3f(image);
+            json_texture_cache[fullname] = new texture3f(image, true);
         } else if(ext == "png") {
             auto image = read_png(fullname,true);
-            json_texture_cache[fullname] = new image3f(image);
+            json_texture_cache[fullname] = new texture3f(image, false);
         } else error("unsupported image format %s\n", ext.c_str());
     }
     txt = json_texture_cache[fullname];
@@ -229,12 +230,36 @@ MeshSimulation* json_parse_mesh_simulation(const jsonvalue& json) {
     return simulation;
 }
 
+map<string,Mesh*>       json_mesh_cache;
+
+// whether a mesh only places its json_mesh, without modifying its geometry
+bool json_is_mesh_instance(const jsonvalue& json) {
+    for(auto name : { "pos", "norm", "texcoord", "triangle", "quad", "point", "line", "spline",
+                      "subdivision_catmullclark_level", "subdivision_catmullclark_smooth", "subdivision_bezier_level",
+                      "skinning", "json_skinning", "simulation" }) {
+        if(json.object_contains(name)) return false;
+    }
+    return true;
+}
+
 Mesh* json_parse_mesh(const jsonvalue& json) {
     auto mesh = new Mesh();
     if(json.object_contains("json_mesh")) {
-        json_texture_path_push(json.object_element("json_mesh").as_string());
-        mesh = json_parse_mesh(load_json(json.object_element("json_mesh").as_string()));
-        json_texture_path_pop();
+        // load each json_mesh once
+        auto filename = json.object_element("json_mesh").as_string();
+        if(json_mesh_cache.find(filename) == json_mesh_cache.end()) {
+            json_texture_path_push(filename);
+            json_mesh_cache[filename] = json_parse_mesh(load_json(filename));
+            json_texture_path_pop();
+        }
+        auto loaded = json_mesh_cache[filename];
+        auto shape = mesh_shape(loaded);
+        // instance its geometry, or copy it if modified or deformed
+        if(json_is_mesh_instance(json) and not shape->skinning and not shape->simulation) mesh->shape = shape;
+        else *mesh = *shape;
+        mesh->frame = loaded->frame;
+        mesh->mat = loaded->mat;
+        mesh->animation = loaded->animation;
     }
     json_set_optvalue(json, mesh->frame, "frame");
     json_set_optvalue(json, mesh->pos, "pos");
@@ -320,21 +345,41 @@ Scene* json_parse_scene(const jsonvalue& json) {
     json_set_optvalue(json, scene->image_width, "image_width");
     json_set_optvalue(json, scene->image_height, "image_height");
     json_set_optvalue(json, scene->image_samples, "image_samples");
+    json_set_optvalue(json, scene->image_seed, "image_seed");
+    json_set_optvalue(json, scene->image_sampler, "image_sampler");
+    json_set_optvalue(json, scene->image_tile_size, "image_tile_size");
+    json_set_optvalue(json, scene->image_progressive, "image_progressive");
+    json_set_optvalue(json, scene->image_time_budget, "image_time_budget");
+    json_set_optvalue(json, scene->image_snapshot_passes, "image_snapshot_passes");
+    json_set_optvalue(json, scene->image_adaptive_threshold, "image_adaptive_threshold");
+    json_set_optvalue(json, scene->image_adaptive_min_samples, "image_adaptive_min_samples");
+    json_set_optvalue(json, scene->image_adaptive_max_samples, "image_adaptive_max_samples");
     json_set_optvalue(json, scene->background, "background");
     json_parse_opttexture(json, scene->background_txt, "background_txt");
     json_set_optvalue(json, scene->ambient, "ambient");
+    json_set_optvalue(json, scene->path_integrator, "path_integrator");
     json_set_optvalue(json, scene->path_max_depth, "path_max_depth");
+    json_set_optvalue(json, scene->path_russian_roulette, "path_russian_roulette");
+    json_set_optvalue(json, scene->path_rr_min_depth, "path_rr_min_depth");
+    json_set_optvalue(json, scene->path_wavefront, "path_wavefront");
     json_set_optvalue(json, scene->path_sample_brdf, "path_sample_brdf");
     json_set_optvalue(json, scene->path_shadows, "path_shadows");
+    json_set_optvalue(json, scene->path_light_samples, "path_light_samples");
+    json_set_optvalue(json, scene->path_light_sampling, "path_light_sampling");
+    json_set_optvalue(json, scene->path_mis, "path_mis");
+    json_set_optvalue(json, scene->path_env_sampling, "path_env_sampling");
+    json_set_optvalue(json, scene->bvh_cache, "bvh_cache");
     // done
     return scene;
 }
 
 Scene* load_json_scene(const string& filename) {
     json_texture_cache.clear();
+    json_mesh_cache.clear();
     json_texture_paths = { "" };
     auto scene = json_parse_scene(load_json(filename));
     json_texture_cache.clear();
+    json_mesh_cache.clear();
     json_texture_paths = { "" };
     return scene;
 }
@@ -5,6 +5,7 @@
 #include "json.h"
 #include "vmath.h"
 #include "image.h"
+#include "montecarlo.h"
 
 // forward declarations
 struct BVHAccelerator;
@@ -18,11 +19,11 @@ struct Material {
     float       n = 10;             // specular exponent
     vec3f       kr = zero3f;        // reflection coefficient
     
-    image3f*    ke_txt = nullptr;   // emission texture
-    image3f*    kd_txt = nullptr;   // diffuse texture
-    image3f*    ks_txt = nullptr;   // specular texture
-    image3f*    kr_txt = nullptr;   // reflection texture
-    image3f*    norm_txt = nullptr; // normal texture
+    texture3f*  ke_txt = nullptr;   // emission texture
+    texture3f*  kd_txt = nullptr;   // diffuse texture
+    texture3f*  ks_txt = nullptr;   // specular texture
+    texture3f*  kr_txt = nullptr;   // reflection texture
+    texture3f*  norm_txt = nullptr; // normal texture
     
     bool        double_sided = false;   // double-sided material
     bool        microfacet = false; // use microfacet formulation
@@ -97,8 +98,15 @@ struct Mesh {
     MeshCollision*  collision = nullptr;        // collision data
     
     BVHAccelerator* bvh = nullptr;              // bvh accelerator for intersection
+    
+    Mesh*           shape = nullptr;            // mesh with the geometry and bvh shared by this instance
+    int             _frame_kind = 0;            // frame kind, cached for intersection
+    int             _emitter = -1;              // emitter index, cached for light sampling (-1 if none)
 };
 
+// mesh holding the geometry of a mesh, i.e. the shared one for instances
+inline Mesh* mesh_shape(Mesh* mesh) { return (mesh->shape) ? mesh->shape : mesh; }
+
 // surface made of eitehr a spehre or a quad (as determined by
 // isquad. the sphere is centered frame.o with radius radius.
 // the quad is at frame.o with normal frame.z and axes frame.x, frame.y.
@@ -112,6 +120,8 @@ struct Surface {
     FrameAnimation* animation = nullptr;    // animation data
 
     Mesh*       _display_mesh = nullptr;    // display mesh
+    int         _frame_kind = 0;            // frame kind, cached for intersection
+    int         _emitter = -1;              // emitter index, cached for light sampling (-1 if none)
 };
 
 // point light at frame.o with intensity intensity
@@ -120,6 +130,30 @@ struct Light {
     vec3f       intensity = one3f;              // intersntiy
 };
 
+// emitter sampled for direct illumination, either a point light, an emissive surface
+// or an emissive mesh
+struct Emitter {
+    Light*      light = nullptr;                // point light
+    Surface*    surface = nullptr;              // emissive surface
+    Mesh*       mesh = nullptr;                 // emissive mesh
+    AliasTable  triangles;                      // distribution picking mesh triangles by area
+    float       area = 0;                       // mesh area
+    float       power = 0;                      // emitted power, to pick it among the others
+    int         node = -1;                      // light bvh leaf
+};
+
+// node of the light bvh, clustering emitters by position and by the cone bounding
+// their normals, used to pick emitters by their estimated contribution at a point
+struct LightNode {
+    range3f     bbox;                           // emitters bounds
+    vec3f       axis = z3f;                     // normals cone axis
+    float       theta = pif;                    // normals cone half-angle (pi for all directions)
+    float       power = 0;                      // emitters power
+    int         left = -1, right = -1;          // children
+    int         parent = -1;                    // parent (-1 for the root)
+    int         emitter = -1;                   // emitter, for leaves
+};
+
 // perspective camera at frame.o with direction (-z)
 // and image plane orientation (x,y); the image plane
 // is at a distance dist with size (width,height);
@@ -144,6 +178,15 @@ struct SceneAnimation {
     bool    loop = false;                   // whether to loop the animation
 };
 
+// path integrators, light sampling strategies and mis heuristics, in the order of their names
+#define path_integrator_recursive 0     // recursive, sampling the brdf to a fixed depth
+#define path_integrator_iterative 1     // iterative, with throughput and russian roulette
+#define path_light_sampling_power 0     // pick emitters by power
+#define path_light_sampling_bvh 1       // pick emitters by estimated contribution with the light bvh
+#define path_mis_none 0                 // no mis, area lights reached by light samples only
+#define path_mis_balance 1              // balance heuristic
+#define path_mis_power 2                // power heuristic
+
 // scene comprised of a camera, a list of meshes,
 // and a list of lights. rendering parameters are
 // also included, namely the background color (color
@@ -155,9 +198,15 @@ struct Scene {
     vector<Mesh*>       meshes;                 // meshes
     vector<Surface*>    surfaces;               // surfaces
     vector<Light*>      lights;                 // lights
+    BVHAccelerator*     bvh = nullptr;          // top-level bvh over surfaces and meshes
+    string              bvh_cache = "";         // directory caching mesh bvhs across runs (disabled if empty)
+    vector<Emitter>     emitters;               // emitters for direct illumination, built before rendering
+    AliasTable          emitters_table;         // distribution picking emitters by power
+    vector<LightNode>   emitters_bvh;           // light bvh over the emitters, picking them by contribution
     
     vec3f               background = one3f*0.2; // background color
-    image3f*            background_txt = nullptr;// background texture
+    texture3f*          background_txt = nullptr;// background texture
+    Distribution2D      background_distribution;// distribution sampling background_txt, built before rendering
     vec3f               ambient = one3f*0.2;    // ambient illumination
 
     SceneAnimation*     animation = new SceneAnimation();    // scene animation data
@@ -165,6 +214,16 @@ struct Scene {
     int                 image_width = 512;      // image resolution in x
     int                 image_height = 512;     // image resolution in y
     int                 image_samples = 1;      // samples per pixels in each direction
+    int                 image_seed = 0;         // seed of the random numbers of each sample
+    string              image_sampler = "random";   // sampler of the random numbers (random, sobol, halton, r2)
+    int                 _sampler = rng_sampler_random;  // sampler, cached for rendering
+    int                 image_tile_size = 32;   // size of the image tiles scheduled for rendering
+    bool                image_progressive = false;  // render one stratified pass at a time
+    float               image_time_budget = 0;  // progressive rendering time budget in seconds (0 for none)
+    int                 image_snapshot_passes = 0;  // passes between progressive snapshots (0 for none)
+    float               image_adaptive_threshold = 0;   // relative error threshold for adaptive sampling (0 for none)
+    int                 image_adaptive_min_samples = 16;// min samples per pixel for adaptive sampling
+    int                 image_adaptive_max_samples = 0; // max samples per pixel for adaptive sampling (0 for image_samples^2)
     
     bool                draw_wireframe = false; // whether to use wireframe for interactive drawing
     bool                draw_animated = false;  // whether to draw with animation
@@ -172,13 +231,24 @@ struct Scene {
     bool                draw_captureimage = false;  // whether to capture the image in the next frame
     bool                draw_normals = false;       // whether to draw normals for debugging
     
+    string              path_integrator = "recursive";  // path integrator (recursive, iterative)
+    int                 _integrator = path_integrator_recursive;    // path integrator, cached for rendering
     int                 path_max_depth = 2;     // maximum path depth
+    bool                path_russian_roulette = true;   // terminate paths by russian roulette (iterative only)
+    int                 path_rr_min_depth = 3;  // path depth where russian roulette starts
+    bool                path_wavefront = false; // render with the wavefront engine
     bool                path_sample_brdf = true;// sample brdf in path tracing
     bool                path_shadows = true;    // whether to compute shadows
+    int                 path_light_samples = 0; // lights sampled at each shading point (0 for all lights)
+    string              path_light_sampling = "power";  // how lights are sampled (power, bvh)
+    string              path_mis = "none";      // heuristic combining light and brdf samples (none, balance, power)
+    int                 _light_sampling = path_light_sampling_power;    // light sampling, cached for rendering
+    int                 _mis = path_mis_none;   // mis heuristic, cached for rendering
+    bool                path_env_sampling = false;  // importance sample background_txt (adding brdf samples with mis)
 };
 
 // grab all scene textures
-vector<image3f*> get_textures(Scene* scene);
+vector<texture3f*> get_textures(Scene* scene);
 
 // create a Camera at eye, pointing towards center with up vector up, and with specified image plane params
 Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
@@ -10,4 +10,10 @@
 
 ..\bin\Release\pathtrace 06_cb_direct.json
 
-..\bin\Release\pathtrace 07_cb_indirect.json
+..\bin\Release\pathtrace 07_cb_indirect.json
+
+..\bin\Release\pathtrace -q sobol 07_cb_indirect.json 07_cb_indirect.sobol.png
+
+..\bin\Release\pathtrace -q halton 07_cb_indirect.json 07_cb_indirect.halton.png
+
+..\bin\Release\pathtrace -q r2 07_cb_indirect.json 07_cb_indirect.r2.png
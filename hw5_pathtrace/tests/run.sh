@@ -5,3 +5,6 @@
 ../bin/pathtrace 05_materials.json
 ../bin/pathtrace 06_cb_direct.json
 ../bin/pathtrace 07_cb_indirect.json
+../bin/pathtrace -q sobol 07_cb_indirect.json 07_cb_indirect.sobol.png
+../bin/pathtrace -q halton 07_cb_indirect.json 07_cb_indirect.halton.png
+../bin/pathtrace -q r2 07_cb_indirect.json 07_cb_indirect.r2.png